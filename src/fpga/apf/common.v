@@ -96,7 +96,7 @@ module bram_block_dp #(
    output reg  [DATA-1:0] b_dout
 );
 
-reg [DATA-1:0] mem [(2**ADDR)-1:0];
+reg [DATA-1:0] mem [(2**ADDR)-1:0] /* verilator public */;
 
 always @(posedge a_clk) begin
    if(a_wr) begin
@@ -0,0 +1,31 @@
+#!/bin/bash
+
+# Build core_top-sim for 1, 2, 4 and 8 Verilator threads and report simulated
+# frames per second on a fixed workload (BASIC boot followed by a G64 load).
+#
+# Usage: ./bench-threads.sh <file.g64> [exit-frame]
+
+set -e
+
+G64=$1
+EXIT_FRAME=${2:-1500}
+KEYS="[150]LOAD<LSHIFT>2*<LSHIFT>2,8,1<RETURN>"
+
+if [ -z "$G64" ]; then
+  echo "Usage: $0 <file.g64> [exit-frame]"
+  exit 1
+fi
+
+for t in 1 2 4 8; do
+  THREADS=$t ./build-sim.sh > build-mt$t.log 2>&1
+done
+
+printf "%-8s %-10s %-10s\n" "threads" "seconds" "frames/s"
+for t in 1 2 4 8; do
+  if [ $t -gt 1 ]; then SIM=./core_top-sim-mt$t; else SIM=./core_top-sim; fi
+  start=$(date +%s.%N)
+  $SIM --exit-frame $EXIT_FRAME --g64 "$G64" --keys "$KEYS" > /dev/null
+  end=$(date +%s.%N)
+  awk -v t=$t -v s=$start -v e=$end -v f=$EXIT_FRAME \
+    'BEGIN { printf "%-8d %-10.2f %-10.2f\n", t, e - s, f / (e - s) }'
+done
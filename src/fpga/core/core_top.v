@@ -26,17 +26,20 @@ module core_top (
     output wire debug_iec_clock,
     output wire debug_1mhz_ph1_en,
     output wire debug_1mhz_ph2_en,
+    output wire [15:0] debug_sid_wave,
 
     output wire debug_c64_cpu_valid,
     output wire debug_c64_cpu_sync,
     output wire [15:0] debug_c64_cpu_addr,
     output wire [7:0] debug_c64_cpu_data,
+    output wire debug_c64_cpu_we,
     output wire [63:0]debug_c64_cpu_regs,
 
     output wire debug_c1541_cpu_valid,
     output wire debug_c1541_cpu_sync,
     output wire [15:0] debug_c1541_cpu_addr,
     output wire [7:0] debug_c1541_cpu_data,
+    output wire debug_c1541_cpu_we,
     output wire [63:0]debug_c1541_cpu_regs,
 
     ///////////////////////////////////////////////////
@@ -547,6 +550,7 @@ module core_top (
   assign debug_iec_clock = iec_clock;
   assign debug_1mhz_ph1_en = clk_8mhz_1mhz_ph1_en;
   assign debug_1mhz_ph2_en = clk_8mhz_1mhz_ph2_en;
+  assign debug_sid_wave = sid_wave;
 
   myc64_top u_myc64 (
       .rst(ph_synced_rst),
@@ -583,6 +587,7 @@ module core_top (
       .o_debug_6510_sync(debug_c64_cpu_sync),
       .o_debug_6510_addr(debug_c64_cpu_addr),
       .o_debug_6510_data(debug_c64_cpu_data),
+      .o_debug_6510_we(debug_c64_cpu_we),
       .o_debug_6510_regs(debug_c64_cpu_regs)
   );
 
@@ -624,6 +629,7 @@ module core_top (
       .o_debug_6502_sync(debug_c1541_cpu_sync),
       .o_debug_6502_addr(debug_c1541_cpu_addr),
       .o_debug_6502_data(debug_c1541_cpu_data),
+      .o_debug_6502_we(debug_c1541_cpu_we),
       .o_debug_6502_regs(debug_c1541_cpu_regs)
   );
 
@@ -38,6 +38,7 @@ class Cpu6502(Elaboratable):
     self.o_debug_sync = Signal()
     self.o_debug_addr = Signal(16)
     self.o_debug_data = Signal(8)
+    self.o_debug_we = Signal()
     self.o_debug_regs = Signal(64)
 
   def elaborate(self, platform):
@@ -76,5 +77,6 @@ class Cpu6502(Elaboratable):
 
     m.d.comb += [self.o_addr.eq(addr), self.o_data.eq(data_o), self.o_we.eq(~we_n)]
     m.d.comb += [self.o_debug_valid.eq(self.clk_1mhz_ph1_en), self.o_debug_sync.eq(sync), self.o_debug_addr.eq(addr), self.o_debug_data.eq(data_ir)]
+    m.d.comb += self.o_debug_we.eq(~we_n)
 
     return m
@@ -56,6 +56,7 @@ class My1541(Elaboratable):
     self.o_debug_6502_sync = Signal()
     self.o_debug_6502_addr = Signal(16)
     self.o_debug_6502_data = Signal(8)
+    self.o_debug_6502_we = Signal()
     self.o_debug_6502_regs = Signal(64)
 
     self.ports = [
@@ -63,7 +64,7 @@ class My1541(Elaboratable):
         self.i_track_data, self.i_track_len, self.o_track_no, self.o_led_on, self.o_motor_on, self.i_clk_1mhz_ph1_en,
         self.i_clk_1mhz_ph2_en, self.i_iec_atn_in, self.i_iec_data_in, self.o_iec_data_out, self.i_iec_clock_in,
         self.o_iec_clock_out, self.o_debug_6502_valid, self.o_debug_6502_sync, self.o_debug_6502_addr,
-        self.o_debug_6502_data, self.o_debug_6502_regs
+        self.o_debug_6502_data, self.o_debug_6502_we, self.o_debug_6502_regs
     ]
 
   def elaborate(self, platform):
@@ -111,6 +112,7 @@ class My1541(Elaboratable):
       self.o_debug_6502_sync.eq(u_cpu_.o_debug_sync),
       self.o_debug_6502_addr.eq(u_cpu_.o_debug_addr),
       self.o_debug_6502_data.eq(u_cpu_.o_debug_data),
+      self.o_debug_6502_we.eq(u_cpu_.o_debug_we),
       self.o_debug_6502_regs.eq(u_cpu_.o_debug_regs),
     ]
 
@@ -38,6 +38,7 @@ class Cpu6510(Elaboratable):
     self.o_debug_sync = Signal()
     self.o_debug_addr = Signal(16)
     self.o_debug_data = Signal(8)
+    self.o_debug_we = Signal()
     self.o_debug_regs = Signal(64)
 
   def elaborate(self, platform):
@@ -84,6 +85,7 @@ class Cpu6510(Elaboratable):
     m.d.comb += we.eq(~we_n)
     m.d.comb += [self.o_addr.eq(addr), self.o_data.eq(data_o), self.o_we.eq(we)]
     m.d.comb += [self.o_debug_valid.eq(clk_enable), self.o_debug_sync.eq(sync), self.o_debug_addr.eq(addr), self.o_debug_data.eq(data_i)]
+    m.d.comb += self.o_debug_we.eq(we)
 
     port_dir = Signal(6)
     port = Signal(6)
@@ -137,6 +137,7 @@ class MyC64(Elaboratable):
     self.o_debug_6510_sync = Signal()
     self.o_debug_6510_addr = Signal(16)
     self.o_debug_6510_data = Signal(8)
+    self.o_debug_6510_we = Signal()
     self.o_debug_6510_regs = Signal(64)
 
     self.ports = [
@@ -146,7 +147,7 @@ class MyC64(Elaboratable):
         self.i_ram_main_data, self.o_ram_main_data, self.o_ram_main_we,
         self.o_iec_atn_out, self.i_iec_data_in , self.o_iec_data_out, self.i_iec_clock_in, self.o_iec_clock_out,
         self.i_cart_type, self.o_cart_addr, self.o_cart_we, self.i_cart_data, self.o_cart_data,
-        self.o_debug_6510_valid, self.o_debug_6510_sync, self.o_debug_6510_addr, self.o_debug_6510_data, self.o_debug_6510_regs
+        self.o_debug_6510_valid, self.o_debug_6510_sync, self.o_debug_6510_addr, self.o_debug_6510_data, self.o_debug_6510_we, self.o_debug_6510_regs
     ]
 
   def elaborate(self, platform):
@@ -226,6 +227,7 @@ class MyC64(Elaboratable):
       self.o_debug_6510_sync.eq(u_cpu.o_debug_sync),
       self.o_debug_6510_addr.eq(u_cpu.o_debug_addr),
       self.o_debug_6510_data.eq(u_cpu.o_debug_data),
+      self.o_debug_6510_we.eq(u_cpu.o_debug_we),
       self.o_debug_6510_regs.eq(u_cpu.o_debug_regs),
     ]
 
@@ -19,235 +19,2009 @@
  */
 
 #include "CLI11.hpp"
+#include "trace6502.h"
 
 #include "Vcore_top.h"
+#include "Vcore_top___024root.h"
+#include "Vcore_top__Syms.h"
 #include "Vcore_top_core_top.h"
 #include "Vcore_top_spram__A10_D8.h"
 #include "verilated.h"
 #include "verilated_fst_c.h"
+#include "verilated_save.h"
+#include <algorithm>
+#include <array>
 #include <assert.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <errno.h>
 #include <fstream>
 #include <functional>
+#if !SIM_HEADLESS
 #include <gtk/gtk.h>
+#endif
 #include <iostream>
+#include <limits>
+#include <map>
+#include <math.h>
+#include <mutex>
+#include <sstream>
+#include <set>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <thread>
+#include <tuple>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <vector>
+#if SIM_HEADLESS
+#include <zlib.h>
+#endif
 
 #define CLK_32MHZ 1
 
+// Save/restore needs a model built with --savable (not used for the
+// multi-threaded build)
+#ifndef SIM_SAVABLE
+#define SIM_SAVABLE 1
+#endif
+
+// Headless build uses a built-in .png writer instead of GdkPixbuf so the
+// simulator does not depend on gtk+-3.0
+#ifndef SIM_HEADLESS
+#define SIM_HEADLESS 0
+#endif
+
 #define CRT_SLOT_ID 0
 #define PRG_SLOT_ID 1
 #define G64_SLOT_ID 2
 
+#define STATE_MAGIC 0x4d433637 // 'MC67', bumped on state layout changes
+
+// One tick is half a clk_32mhz period
+#define TICKS_PER_SECOND 64000000.0
+
 static uint64_t g_ticks = 0;
 static uint32_t g_frame_idx = 0;
 
 static std::unique_ptr<Vcore_top> dut;
 
-using Memory = std::array<uint8_t, 0x10000>;
-unsigned disasm(FILE *fp, const Memory &mem, uint16_t addr);
 
-class SimplePSRAM {
+// Plain data members of the harness classes are saved/restored as raw bytes
+// next to the Verilated model state. Classes with state to checkpoint expose
+// it through a VisitState(f) member that calls f on each such member.
+template <typename T> static void SaveRaw(VerilatedSerialize &os, const T &v) {
+  os.write(&v, sizeof(v));
+}
+template <typename T> static void RestoreRaw(VerilatedDeserialize &is, T &v) {
+  is.read(&v, sizeof(v));
+}
+
+// Clock domain driven by the main loop. The clock toggles every half_period
+// ticks and the loop only evaluates the model on ticks where an enabled clock
+// has an edge.
+struct SimClock {
+  uint8_t &signal;
+  uint64_t half_period;
+  bool enabled;
+
+  uint64_t NextEdge() const {
+    return (g_ticks + half_period - 1) / half_period * half_period;
+  }
+  // Toggle if there is an edge on the current tick, returns true on posedge
+  bool Edge() {
+    if (!enabled || g_ticks % half_period != 0)
+      return false;
+    signal = !signal;
+    return signal;
+  }
+};
+
+class AsyncSink;
+
+// Background thread that does the file writes queued by all AsyncSinks
+class AsyncWriter {
+public:
+  static AsyncWriter &Instance() {
+    static AsyncWriter writer;
+    return writer;
+  }
+  void Register(AsyncSink *sink) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    sinks_.push_back(sink);
+  }
+  // Also waits for a drain pass that may still be using 'sink' to finish
+  void Unregister(AsyncSink *sink) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    sinks_.erase(std::find(sinks_.begin(), sinks_.end(), sink));
+    done_.wait(lock, [this] { return !draining_; });
+  }
+  // Request a drain pass
+  void Kick() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_ = true;
+    }
+    wake_.notify_one();
+  }
+  // Request a drain pass and wait until 'pred' holds after one
+  template <typename P> void Wait(P &&pred) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    pending_ = true;
+    wake_.notify_one();
+    done_.wait(lock, pred);
+  }
+
+private:
+  AsyncWriter() : thread_([this] { Run(); }) {}
+  // Runs on exit() too, so whatever is left in sinks that were never closed
+  // still ends up in their files. Exits non-zero if any write failed.
+  ~AsyncWriter();
+  void Run();
+
+  // The mutex only guards the sink list and the pass state, the ring buffers
+  // are written out without holding it
+  std::mutex mutex_;
+  std::condition_variable wake_; // Pass requested
+  std::condition_variable done_; // Pass finished
+  std::vector<AsyncSink *> sinks_;
+  bool pending_ = false;
+  bool draining_ = false;
+  bool stop_ = false;
+  bool failed_ = false; // Writer thread only
+  std::thread thread_;
+};
+
+// Output file for the simulation thread (single producer). File() is a
+// regular stdio stream but what is flushed from it only goes into a ring
+// buffer, from which the AsyncWriter thread does large sequential writes.
+// Takes ownership of 'fd', 'name' is used in error messages.
+class AsyncSink {
+public:
+  AsyncSink(int fd, const std::string &name, size_t ring_size = 8 << 20)
+      : fd_(fd), name_(name), ring_(ring_size), mask_(ring_size - 1) {
+    assert((ring_size & mask_) == 0);
+    cookie_io_functions_t io = {nullptr, CookieWrite, nullptr, nullptr};
+    fp_ = fopencookie(this, "w", io);
+    setvbuf(fp_, nullptr, _IOFBF, 64 << 10);
+    AsyncWriter::Instance().Register(this);
+  }
+  ~AsyncSink() {
+    fclose(fp_);
+    // Wait for the writer to catch up
+    AsyncWriter::Instance().Wait([this] {
+      return head_.load(std::memory_order_acquire) ==
+             tail_.load(std::memory_order_acquire);
+    });
+    AsyncWriter::Instance().Unregister(this);
+    close(fd_);
+  }
+  FILE *File() { return fp_; }
+  // Write out everything queued so far (writer thread only). After a write
+  // error everything is dropped and false returned.
+  bool Drain() {
+    size_t head = head_.load(std::memory_order_acquire);
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    bool ok = !write_error_;
+    while (ok && tail != head) {
+      size_t len = std::min(head - tail, ring_.size() - (tail & mask_));
+      ssize_t n = write(fd_, &ring_[tail & mask_], len);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0) {
+        std::cerr << "Unable to write '" << name_
+                  << "': " << strerror(n < 0 ? errno : EIO) << "\n";
+        write_error_ = true;
+        ok = false;
+        break;
+      }
+      tail += n;
+      tail_.store(tail, std::memory_order_release);
+    }
+    tail_.store(head, std::memory_order_release);
+    return ok;
+  }
+
+  static int Open(const std::string &path) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      std::cerr << "Unable to open '" << path << "'\n";
+      exit(1);
+    }
+    return fd;
+  }
+
+private:
+  static ssize_t CookieWrite(void *cookie, const char *buf, size_t size) {
+    auto *sink = static_cast<AsyncSink *>(cookie);
+    size_t head = sink->head_.load(std::memory_order_relaxed);
+    for (size_t done = 0; done < size;) {
+      size_t space = sink->ring_.size() -
+                     (head - sink->tail_.load(std::memory_order_acquire));
+      if (space == 0) {
+        AsyncWriter::Instance().Wait([&] {
+          return head - sink->tail_.load(std::memory_order_acquire) <
+                 sink->ring_.size();
+        });
+        continue;
+      }
+      size_t len = std::min({size - done, space,
+                             sink->ring_.size() - (head & sink->mask_)});
+      memcpy(&sink->ring_[head & sink->mask_], buf + done, len);
+      head += len;
+      done += len;
+      sink->head_.store(head, std::memory_order_release);
+    }
+    AsyncWriter::Instance().Kick();
+    return size;
+  }
+
+  int fd_;
+  std::string name_;
+  bool write_error_ = false;
+  FILE *fp_;
+  std::vector<char> ring_;
+  size_t mask_;
+  std::atomic<size_t> head_{0}; // Producer position
+  std::atomic<size_t> tail_{0}; // Writer position
+};
+
+AsyncWriter::~AsyncWriter() {
+  // Flushing may have to wait for ring buffer space so the thread must still
+  // be running. Only the simulation thread registers sinks.
+  for (auto *sink : sinks_)
+    fflush(sink->File());
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  wake_.notify_one();
+  thread_.join();
+  for (auto *sink : sinks_)
+    failed_ |= !sink->Drain();
+  if (failed_) {
+    fflush(stdout);
+    _exit(1);
+  }
+}
+
+void AsyncWriter::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    wake_.wait(lock, [this] { return pending_ || stop_; });
+    if (stop_)
+      break;
+    pending_ = false;
+    draining_ = true;
+    std::vector<AsyncSink *> sinks = sinks_;
+    lock.unlock();
+    bool ok = true;
+    for (auto *sink : sinks)
+      ok &= sink->Drain();
+    lock.lock();
+    failed_ |= !ok;
+    draining_ = false;
+    done_.notify_all();
+  }
+}
+
+// PSRAM timing in ns (--psram-timing), defaults as the psram.sv parameters
+// with the same meaning
+struct PSRAMTiming {
+  unsigned access = 70;      // MAX_ACCESS_TIME_FROM_ADV
+  unsigned write = 70;       // MIN_WRITE_TIME_FROM_ADV
+  unsigned write_pulse = 45; // MIN_WRITE_PULSE
+
+  // Comma separated list of access=NS, write=NS and pulse=NS
+  static PSRAMTiming Parse(const std::string &spec) {
+    PSRAMTiming t;
+    std::stringstream ss(spec);
+    std::string item;
+    try {
+      while (std::getline(ss, item, ',')) {
+        auto eq = item.find('=');
+        if (eq == std::string::npos)
+          throw std::invalid_argument(item);
+        auto key = item.substr(0, eq);
+        unsigned val = std::stoul(item.substr(eq + 1));
+        if (key == "access")
+          t.access = val;
+        else if (key == "write")
+          t.write = val;
+        else if (key == "pulse")
+          t.write_pulse = val;
+        else
+          throw std::invalid_argument(item);
+      }
+    } catch (const std::logic_error &) {
+      std::cerr << "Bad PSRAM timing '" << spec << "'\n";
+      exit(1);
+    }
+    return t;
+  }
+};
+
+// Both dies of cram0 as driven asynchronously by psram.sv. Memory is allocated
+// in 4 KB pages on first write, the rest reads as zero. Read data only shows
+// up on dq once the access time since adv_n went low has passed (0xffff
+// before that), and writes shorter than the write time or pulse width are
+// counted as violations. Accesses, bytes and busy (chip enabled) cycles are
+// counted per frame and optionally written as .csv (--psram-stats).
+class PagedPSRAM {
 public:
-  SimplePSRAM() {}
+  static constexpr uint32_t c_DieWords = 4 * 1024 * 1024;
+  static constexpr uint32_t c_PageWords = 2048;
+  static constexpr uint32_t c_NumPages = 2 * c_DieWords / c_PageWords;
+
+  PagedPSRAM(const PSRAMTiming &timing)
+      : timing_(timing), pages_(c_NumPages) {}
+
+  void OpenStats(const std::string &path) {
+    stats_ = std::make_unique<AsyncSink>(AsyncSink::Open(path), path);
+    fprintf(stats_->File(), "frame,reads,writes,bytes,busy_cycles,cycles\n");
+  }
+
   void Tick() {
-    if (dut->clk_32mhz) {
-      if (!dut->cram0_adv_n) {
-        addr_ = (dut->cram0_a << 16) | dut->cram0_dq;
-        assert(addr_ < mem_.size());
+    if (!dut->clk_32mhz)
+      return;
+    frame_.cycles++;
+    bool ce0 = !dut->cram0_ce0_n, ce1 = !dut->cram0_ce1_n;
+    if (!ce0 && !ce1) {
+      if (state_.active)
+        EndAccess();
+      return;
+    }
+    frame_.busy_cycles++;
+    // The outputs of psram.sv are seen here one clk_32mhz cycle after they
+    // were driven, which cancels out for durations but not for the time
+    // until data is sampled
+    if (!state_.active) {
+      state_ = AccessState();
+      state_.active = true;
+      state_.start_tick = g_ticks;
+    }
+    if (!dut->cram0_we_n && !state_.we) {
+      state_.we = true;
+      state_.we_tick = g_ticks;
+    }
+    if (!dut->cram0_adv_n) {
+      state_.addr =
+          (ce1 ? c_DieWords : 0) | (dut->cram0_a << 16) | dut->cram0_dq;
+    } else if (!dut->cram0_we_n) {
+      // Last data before the end of the access is what gets written
+      state_.data = dut->cram0_dq;
+      state_.ub = !dut->cram0_ub_n;
+      state_.lb = !dut->cram0_lb_n;
+    } else if (!dut->cram0_oe_n) {
+      state_.read = true;
+      if (Ns(g_ticks - state_.start_tick) + c_CycleNs >= timing_.access) {
+        state_.read_valid = true;
+        dut->cram0_dq = Read(state_.addr);
+      } else {
+        dut->cram0_dq = 0xffff;
+      }
+    }
+  }
+
+  void Frame() {
+    if (stats_)
+      fprintf(stats_->File(), "%u,%u,%u,%u,%u,%u\n", g_frame_idx, frame_.reads,
+              frame_.writes, frame_.bytes, frame_.busy_cycles, frame_.cycles);
+    total_.reads += frame_.reads;
+    total_.writes += frame_.writes;
+    total_.bytes += frame_.bytes;
+    total_.busy_cycles += frame_.busy_cycles;
+    total_.cycles += frame_.cycles;
+    if (uint64_t(frame_.busy_cycles) * peak_.cycles >=
+        uint64_t(peak_.busy_cycles) * frame_.cycles) {
+      peak_ = frame_;
+      peak_frame_ = g_frame_idx;
+    }
+    frame_ = Counters();
+  }
+
+  void Report() const {
+    printf("psram: reads=%lu, writes=%lu, bytes=%lu, busy=%.2f%%, "
+           "peak-busy=%.2f%% (frame %u), pages=%u, late-reads=%lu, "
+           "short-writes=%lu\n",
+           total_.reads, total_.writes, total_.bytes,
+           100.0 * total_.busy_cycles / std::max<uint64_t>(total_.cycles, 1),
+           100.0 * peak_.busy_cycles / std::max<uint32_t>(peak_.cycles, 1),
+           peak_frame_, NumPages(), late_reads_, short_writes_);
+  }
+
+  // Backdoor access (ModelMemory), not counted nor timed
+  uint16_t Peek(uint32_t addr) const { return Read(addr); }
+  void Poke(uint32_t addr, uint16_t data) { Word(addr) = data; }
+
+  // Pages are visited after the bitmap of allocated ones so that restoring
+  // allocates (and frees) pages as in the saved state
+  template <typename F> void VisitState(F &&f) {
+    f(allocated_);
+    for (uint32_t i = 0; i < c_NumPages; i++) {
+      if (allocated_[i / 64] >> (i % 64) & 1) {
+        if (!pages_[i])
+          pages_[i] = std::make_unique<Page>();
+        f(*pages_[i]);
       } else {
-        if (!dut->cram0_we_n) {
-          // Write
-          if (!dut->cram0_ub_n)
-            mem_[addr_] = (mem_[addr_] & 0x00ff) | (dut->cram0_dq & 0xff00);
-          if (!dut->cram0_lb_n)
-            mem_[addr_] = (mem_[addr_] & 0xff00) | (dut->cram0_dq & 0x00ff);
+        pages_[i].reset();
+      }
+    }
+    f(state_);
+  }
+
+private:
+  using Page = std::array<uint16_t, c_PageWords>;
+  template <typename T> struct CountersT {
+    T reads = 0, writes = 0, bytes = 0, busy_cycles = 0, cycles = 0;
+  };
+  using Counters = CountersT<uint32_t>;
+  struct AccessState {
+    bool active = false;
+    bool we = false;
+    bool read = false;
+    bool read_valid = false;
+    bool ub = false, lb = false;
+    uint16_t data = 0;
+    uint32_t addr = 0;
+    uint64_t start_tick = 0;
+    uint64_t we_tick = 0;
+  };
+
+  // One tick is half a clk_32mhz cycle
+  static constexpr double c_CycleNs = 31.25;
+  static double Ns(uint64_t ticks) { return ticks * (c_CycleNs / 2); }
+
+  uint16_t Read(uint32_t addr) const {
+    auto &page = pages_[addr / c_PageWords];
+    return page ? (*page)[addr % c_PageWords] : 0;
+  }
+  // For writing, allocating the page if needed
+  uint16_t &Word(uint32_t addr) {
+    uint32_t idx = addr / c_PageWords;
+    if (!pages_[idx]) {
+      pages_[idx] = std::make_unique<Page>();
+      pages_[idx]->fill(0);
+      allocated_[idx / 64] |= 1ull << (idx % 64);
+    }
+    return (*pages_[idx])[addr % c_PageWords];
+  }
+  void EndAccess() {
+    if (state_.we) {
+      if (Ns(g_ticks - state_.start_tick) < timing_.write ||
+          Ns(g_ticks - state_.we_tick) < timing_.write_pulse)
+        Violation(short_writes_, "write shorter than write time/pulse");
+      uint16_t &word = Word(state_.addr);
+      if (state_.ub)
+        word = (word & 0x00ff) | (state_.data & 0xff00);
+      if (state_.lb)
+        word = (word & 0xff00) | (state_.data & 0x00ff);
+      frame_.writes++;
+      frame_.bytes += state_.ub + state_.lb;
+    } else if (state_.read) {
+      if (!state_.read_valid)
+        Violation(late_reads_, "read ended before data was valid");
+      frame_.reads++;
+      frame_.bytes += 2;
+    }
+    state_.active = false;
+  }
+  void Violation(uint64_t &count, const char *what) {
+    if (count++ == 0)
+      fprintf(stderr, "psram: %s at frame %u, address %06x\n", what,
+              g_frame_idx, state_.addr);
+  }
+  uint32_t NumPages() const {
+    uint32_t n = 0;
+    for (auto &p : pages_)
+      n += p != nullptr;
+    return n;
+  }
+
+  PSRAMTiming timing_;
+  std::vector<std::unique_ptr<Page>> pages_;
+  std::array<uint64_t, c_NumPages / 64> allocated_ = {};
+  AccessState state_;
+  Counters frame_;
+  Counters peak_;
+  uint32_t peak_frame_ = 0;
+  CountersT<uint64_t> total_;
+  uint64_t late_reads_ = 0;
+  uint64_t short_writes_ = 0;
+  std::unique_ptr<AsyncSink> stats_;
+};
+
+// When a Trace6502 records (--cpu-c64-trace-trigger and friends). The spec is
+// a comma separated list of
+//   frames=B[-E]  only record in frames B to E
+//   pc=LO-HI      only record instructions within PC range (hex)
+//   start=EVENT   arm on EVENT, either exec:ADDR or write:ADDR (hex)
+//   stop=EVENT    disarm on EVENT (a later start event arms again)
+//   history=N     on arming first emit the last N instructions before it
+struct Trace6502Trigger {
+  enum class Event { None, Exec, Write };
+  struct Cond {
+    Event event = Event::None;
+    uint16_t addr = 0;
+    bool Exec(uint16_t pc) const { return event == Event::Exec && addr == pc; }
+    bool Write(uint16_t a) const { return event == Event::Write && addr == a; }
+  };
+
+  uint32_t begin_frame = 0;
+  uint32_t end_frame = std::numeric_limits<uint32_t>::max();
+  uint16_t pc_lo = 0x0000;
+  uint16_t pc_hi = 0xffff;
+  Cond start;
+  Cond stop;
+  unsigned history = 0;
+
+  static Trace6502Trigger Parse(const std::string &spec) {
+    Trace6502Trigger t;
+    std::stringstream ss(spec);
+    std::string item;
+    try {
+      while (std::getline(ss, item, ',')) {
+        auto eq = item.find('=');
+        if (eq == std::string::npos)
+          throw std::invalid_argument(item);
+        auto key = item.substr(0, eq);
+        auto val = item.substr(eq + 1);
+        auto dash = val.find('-');
+        if (key == "frames") {
+          t.begin_frame = std::stoul(val.substr(0, dash));
+          if (dash != std::string::npos)
+            t.end_frame = std::stoul(val.substr(dash + 1));
+        } else if (key == "pc" && dash != std::string::npos) {
+          t.pc_lo = std::stoul(val.substr(0, dash), nullptr, 16);
+          t.pc_hi = std::stoul(val.substr(dash + 1), nullptr, 16);
+        } else if (key == "start" || key == "stop") {
+          Cond &c = key == "start" ? t.start : t.stop;
+          auto colon = val.find(':');
+          auto kind = val.substr(0, colon);
+          if (colon == std::string::npos ||
+              (kind != "exec" && kind != "write"))
+            throw std::invalid_argument(item);
+          c.event = kind == "exec" ? Event::Exec : Event::Write;
+          c.addr = std::stoul(val.substr(colon + 1), nullptr, 16);
+        } else if (key == "history") {
+          t.history = std::stoul(val);
         } else {
-          // Read
-          dut->cram0_dq = mem_[addr_];
+          throw std::invalid_argument(item);
         }
       }
+    } catch (const std::logic_error &) {
+      std::cerr << "Bad CPU trace trigger '" << spec << "'\n";
+      exit(1);
     }
+    return t;
   }
+};
 
-private:
-  std::array<uint16_t, 2 * 1024 * 1024> mem_;
-  uint32_t addr_ = 0;
+// Opcode and operand bytes of the executing instruction as fetched over the
+// bus, the opcode on the sync cycle and the operands from the first reads of
+// the two addresses following it. Unlike a shadow of the CPU address space
+// this needs no tracking of ROM and I/O banking.
+struct Fetch6502 {
+  uint16_t pc = 0;
+  uint8_t bytes[3] = {};
+  uint8_t fetched = 0; // Mask of bytes seen
+
+  void Cycle(uint8_t sync, uint16_t addr, uint8_t data, uint8_t we) {
+    uint16_t i = addr - pc;
+    if (sync) {
+      pc = addr;
+      bytes[0] = data;
+      fetched = 1;
+    } else if (!we && i < 3 && !(fetched >> i & 1)) {
+      bytes[i] = data;
+      fetched |= 1 << i;
+    }
+  }
 };
 
 class Trace6502 {
 public:
-  Trace6502(const std::string &path, const uint8_t &debug_cpu_valid,
+  Trace6502(const std::string &path, bool binary,
+            const Trace6502Trigger &trigger, const uint8_t &debug_cpu_valid,
             const uint8_t &debug_cpu_sync, const uint16_t &debug_cpu_addr,
-            const uint8_t &debug_cpu_data, const uint64_t &debug_cpu_regs)
-      : debug_cpu_valid_(debug_cpu_valid), debug_cpu_sync_(debug_cpu_sync),
-        debug_cpu_addr_(debug_cpu_addr), debug_cpu_data_(debug_cpu_data),
+            const uint8_t &debug_cpu_data, const uint8_t &debug_cpu_we,
+            const uint64_t &debug_cpu_regs)
+      : binary_(binary), trigger_(trigger),
+        armed_(trigger.start.event == Trace6502Trigger::Event::None),
+        history_(trigger.history), debug_cpu_valid_(debug_cpu_valid),
+        debug_cpu_sync_(debug_cpu_sync), debug_cpu_addr_(debug_cpu_addr),
+        debug_cpu_data_(debug_cpu_data), debug_cpu_we_(debug_cpu_we),
         debug_cpu_regs_(debug_cpu_regs) {
-    fp_ = fopen(path.c_str(), "w");
+    sink_ = std::make_unique<AsyncSink>(AsyncSink::Open(path), path);
+    fp_ = sink_->File();
+    if (binary_) {
+      Trace6502FileHeader hdr;
+      memcpy(hdr.magic, TRACE6502_MAGIC, sizeof(hdr.magic));
+      fwrite(&hdr, sizeof(hdr), 1, fp_);
+    }
   }
   void Tick() {
     if (debug_cpu_valid_) {
-      mem_[debug_cpu_addr_] = debug_cpu_data_;
+      if (debug_cpu_we_) {
+        if (trigger_.start.Write(debug_cpu_addr_))
+          Arm();
+        if (trigger_.stop.Write(debug_cpu_addr_))
+          armed_ = false;
+      }
       if (debug_cpu_sync_) {
-        auto pos = disasm(fp_, mem_, prev_sync_addr);
-        prev_sync_addr = debug_cpu_addr_;
-        while (pos++ < 40)
-          putc(' ', fp_);
-        uint8_t reg_a = debug_cpu_regs_;
-        uint8_t reg_x = debug_cpu_regs_ >> 8;
-        uint8_t reg_y = debug_cpu_regs_ >> 16;
-        uint8_t reg_p = debug_cpu_regs_ >> 24;
-        uint8_t reg_sp = debug_cpu_regs_ >> 32;
-        uint16_t reg_pc = debug_cpu_regs_ >> 48;
-        fprintf(fp_, "[A:$%02X X:$%02X Y:$%02X SP:$%02X ", reg_a, reg_x, reg_y,
-                reg_sp);
+        Trace6502Record r = {};
+        r.ticks = g_ticks;
+        r.frame = g_frame_idx;
+        r.pc = fetch_.pc;
+        memcpy(r.bytes, fetch_.bytes, sizeof(r.bytes));
+        r.a = debug_cpu_regs_;
+        r.x = debug_cpu_regs_ >> 8;
+        r.y = debug_cpu_regs_ >> 16;
+        r.p = debug_cpu_regs_ >> 24;
+        r.sp = debug_cpu_regs_ >> 32;
+        if (trigger_.start.Exec(r.pc))
+          Arm();
+        if (r.frame >= trigger_.begin_frame && r.frame <= trigger_.end_frame &&
+            r.pc >= trigger_.pc_lo && r.pc <= trigger_.pc_hi) {
+          if (armed_)
+            Emit(r);
+          else if (!history_.empty())
+            history_[history_count_++ % history_.size()] = r;
+        }
+        if (trigger_.stop.Exec(r.pc))
+          armed_ = false;
+      }
+      fetch_.Cycle(debug_cpu_sync_, debug_cpu_addr_, debug_cpu_data_,
+                   debug_cpu_we_);
+    }
+  }
+  template <typename F> void VisitState(F &&f) { f(fetch_); }
+
+private:
+  void Emit(const Trace6502Record &r) {
+    if (binary_)
+      fwrite(&r, sizeof(r), 1, fp_);
+    else
+      Trace6502Print(fp_, r);
+  }
+  void Arm() {
+    if (armed_)
+      return;
+    armed_ = true;
+    // Pre-trigger history, oldest first
+    size_t n = std::min<size_t>(history_count_, history_.size());
+    for (size_t i = history_count_ - n; i < history_count_; i++)
+      Emit(history_[i % history_.size()]);
+    history_count_ = 0;
+  }
 
-        fprintf(fp_, " SR:%c%c-%c%c%c%c%c] ", reg_p & 0x80 ? 'N' : '-',
-                reg_p & 0x40 ? 'V' : '-', reg_p & 0x10 ? 'B' : '-',
-                reg_p & 0x08 ? 'D' : '-', reg_p & 0x04 ? 'I' : '-',
-                reg_p & 0x02 ? 'Z' : '-', reg_p & 0x01 ? 'C' : '-');
+  std::unique_ptr<AsyncSink> sink_;
+  FILE *fp_;
+  bool binary_;
+  Trace6502Trigger trigger_;
+  bool armed_;
+  std::vector<Trace6502Record> history_; // Ring of the last instructions
+  uint64_t history_count_ = 0;
+  Fetch6502 fetch_;
+  const uint8_t &debug_cpu_valid_;
+  const uint8_t &debug_cpu_sync_;
+  const uint16_t &debug_cpu_addr_;
+  const uint8_t &debug_cpu_data_;
+  const uint8_t &debug_cpu_we_;
+  const uint64_t &debug_cpu_regs_;
+};
+
+// Cycle profile of a 6502 (--profile-c64/--profile-c1541). Each CPU cycle is
+// attributed to the instruction it belongs to and to the function (JSR target
+// or interrupt handler) executing it. Calls are tracked on a shadow stack that
+// is unwound on the stack pointer, which covers RTS, RTI as well as code that
+// drops return addresses. Report() writes a flat profile to 'path' and a
+// callgrind file to 'path'.callgrind.
+class Profile6502 {
+public:
+  Profile6502(const std::string &path, const uint8_t &debug_cpu_valid,
+              const uint8_t &debug_cpu_sync, const uint16_t &debug_cpu_addr,
+              const uint8_t &debug_cpu_data, const uint8_t &debug_cpu_we,
+              const uint64_t &debug_cpu_regs)
+      : path_(path), debug_cpu_valid_(debug_cpu_valid),
+        debug_cpu_sync_(debug_cpu_sync), debug_cpu_addr_(debug_cpu_addr),
+        debug_cpu_data_(debug_cpu_data), debug_cpu_we_(debug_cpu_we),
+        debug_cpu_regs_(debug_cpu_regs) {}
+  void Tick() {
+    if (!debug_cpu_valid_)
+      return;
+    cycles_++;
+    if (!debug_cpu_sync_) {
+      fetch_.Cycle(0, debug_cpu_addr_, debug_cpu_data_, debug_cpu_we_);
+      // NMI, reset and IRQ/BRK vector fetch
+      if (!debug_cpu_we_ && debug_cpu_addr_ >= 0xfffa)
+        vector_fetch_ = true;
+      return;
+    }
+    if (running_)
+      Retire();
+    running_ = true;
+    fetch_.Cycle(1, debug_cpu_addr_, debug_cpu_data_, 0);
+    last_sync_ = cycles_;
+    vector_fetch_ = false;
+  }
+  void Report() {
+    // Close frames still open as if returning now
+    while (!stack_.empty())
+      Pop();
+
+    std::map<uint32_t, FuncCost> funcs;
+    std::map<uint16_t, Cost> insns;
+    uint64_t total = 0;
+    for (auto &it : self_) {
+      auto &f = funcs[it.first >> 16];
+      f.self += it.second.cycles;
+      auto &i = insns[it.first & 0xffff];
+      i.cycles += it.second.cycles;
+      i.count += it.second.count;
+      memcpy(i.bytes, it.second.bytes, sizeof(i.bytes));
+      total += it.second.cycles;
+    }
+    for (auto &it : calls_) {
+      auto &f = funcs[std::get<2>(it.first)];
+      f.inclusive += it.second.inclusive;
+      f.calls += it.second.count;
+    }
+    funcs[c_Root].inclusive = total;
 
-        fprintf(fp_, "[F:%u C:%lu]\n", g_frame_idx, g_ticks);
+    FILE *fp = fopen(path_.c_str(), "w");
+    fprintf(fp, "# %lu cycles\n#\n", total);
+    fprintf(fp, "#    inclusive         self      calls  function\n");
+    std::vector<std::pair<uint32_t, FuncCost>> by_incl(funcs.begin(),
+                                                        funcs.end());
+    std::sort(by_incl.begin(), by_incl.end(), [](auto &a, auto &b) {
+      return a.second.inclusive > b.second.inclusive;
+    });
+    for (auto &f : by_incl)
+      fprintf(fp, "%14lu %12lu %10lu  %s\n", f.second.inclusive, f.second.self,
+              f.second.calls, FuncName(f.first).c_str());
+    fprintf(fp, "#\n#       cycles       %%      count  instruction\n");
+    std::vector<std::pair<uint16_t, Cost>> by_cycles(insns.begin(),
+                                                      insns.end());
+    std::sort(by_cycles.begin(), by_cycles.end(), [](auto &a, auto &b) {
+      return a.second.cycles > b.second.cycles;
+    });
+    for (auto &i : by_cycles) {
+      fprintf(fp, "%14lu %6.2f%% %10lu  ", i.second.cycles,
+              100.0 * i.second.cycles / std::max<uint64_t>(total, 1),
+              i.second.count);
+      char buf[DISASM_MAX_LEN];
+      fwrite(buf, 1, disasm(buf, sizeof(buf), i.first, i.second.bytes), fp);
+      fputc('\n', fp);
+    }
+    fclose(fp);
+
+    fp = fopen((path_ + ".callgrind").c_str(), "w");
+    fprintf(fp, "# callgrind format\nversion: 1\ncreator: core_top-sim\n");
+    fprintf(fp, "positions: instr\nevents: Cycles\nsummary: %lu\n", total);
+    // self_ and calls_ are both ordered on the function first
+    auto call = calls_.begin();
+    auto self = self_.begin();
+    while (self != self_.end() || call != calls_.end()) {
+      uint32_t fn = self != self_.end() ? self->first >> 16 : c_Root + 1;
+      if (call != calls_.end())
+        fn = std::min(fn, std::get<0>(call->first));
+      fprintf(fp, "\nfn=%s\n", FuncName(fn).c_str());
+      for (; self != self_.end() && self->first >> 16 == fn; self++)
+        fprintf(fp, "0x%04x %lu\n", unsigned(self->first & 0xffff),
+                self->second.cycles);
+      for (; call != calls_.end() && std::get<0>(call->first) == fn; call++) {
+        uint32_t callee = std::get<2>(call->first);
+        fprintf(fp, "cfn=%s\ncalls=%lu 0x%04x\n0x%04x %lu\n",
+                FuncName(callee).c_str(), call->second.count, callee,
+                std::get<1>(call->first), call->second.inclusive);
       }
     }
+    fclose(fp);
   }
 
 private:
-  FILE *fp_;
-  Memory mem_;
-  uint16_t prev_sync_addr;
+  static constexpr uint32_t c_Root = 0x10000; // Outside of any call
+  struct Cost {
+    uint64_t cycles = 0;
+    uint64_t count = 0;
+    uint8_t bytes[3] = {}; // As last executed
+  };
+  struct FuncCost {
+    uint64_t inclusive = 0;
+    uint64_t self = 0;
+    uint64_t calls = 0;
+  };
+  struct Call {
+    uint64_t count = 0;
+    uint64_t inclusive = 0;
+  };
+  struct Frame {
+    uint32_t fn;
+    uint32_t caller;
+    uint16_t site;
+    uint8_t sp; // Stack pointer before the call
+    uint64_t start;
+  };
+
+  static std::string FuncName(uint32_t fn) {
+    char buf[8];
+    snprintf(buf, sizeof(buf), "$%04X", fn);
+    return fn == c_Root ? "<root>" : buf;
+  }
+  uint32_t Current() const {
+    return stack_.empty() ? c_Root : stack_.back().fn;
+  }
+  void Pop() {
+    auto &f = stack_.back();
+    auto &c = calls_[std::make_tuple(f.caller, f.site, f.fn)];
+    c.count++;
+    c.inclusive += last_sync_ - f.start;
+    stack_.pop_back();
+  }
+  void Push(uint32_t fn, uint16_t site, uint8_t sp) {
+    // Stack pointer tracking gone astray, drop the outermost frame
+    if (stack_.size() >= 256)
+      stack_.erase(stack_.begin());
+    stack_.push_back({fn, Current(), site, sp, last_sync_});
+  }
+  // Account the instruction that ended with this sync and track calls
+  void Retire() {
+    uint16_t pc = fetch_.pc;
+    // A vector fetch is either a BRK executing or a hardware interrupt. On an
+    // interrupt the fetched opcode is discarded (replaced by BRK), the
+    // instruction is executed and counted after the return.
+    bool brk = vector_fetch_ && fetch_.bytes[0] == 0x00;
+    bool irq = vector_fetch_ && !brk;
+    bool jsr = !vector_fetch_ && fetch_.bytes[0] == 0x20;
+    auto &c = self_[uint64_t(Current()) << 16 | pc];
+    c.cycles += cycles_ - last_sync_;
+    if (!irq) {
+      c.count++;
+      memcpy(c.bytes, fetch_.bytes, sizeof(c.bytes));
+    }
+    last_sync_ = cycles_;
+
+    // Stack pointer as it was before this instruction and interrupt
+    uint8_t sp = uint8_t(debug_cpu_regs_ >> 32) + (jsr ? 2 : 0) +
+                 (vector_fetch_ ? 3 : 0);
+    while (!stack_.empty() && int8_t(sp - stack_.back().sp) >= 0)
+      Pop();
+    if (jsr)
+      Push(fetch_.bytes[1] | fetch_.bytes[2] << 8, pc, sp);
+    if (vector_fetch_)
+      Push(debug_cpu_addr_, pc, sp);
+  }
+
+  std::string path_;
+  Fetch6502 fetch_;
+  uint64_t cycles_ = 0;
+  uint64_t last_sync_ = 0;
+  bool running_ = false;
+  bool vector_fetch_ = false;
+  std::vector<Frame> stack_;
+  std::map<uint64_t, Cost> self_; // Keyed on function << 16 | pc
+  std::map<std::tuple<uint32_t, uint16_t, uint32_t>, Call> calls_;
   const uint8_t &debug_cpu_valid_;
   const uint8_t &debug_cpu_sync_;
   const uint16_t &debug_cpu_addr_;
   const uint8_t &debug_cpu_data_;
+  const uint8_t &debug_cpu_we_;
   const uint64_t &debug_cpu_regs_;
 };
 
+constexpr uint32_t Profile6502::c_Root;
+
+static volatile sig_atomic_t g_sigusr1 = 0;
+static volatile sig_atomic_t g_sigusr2 = 0;
+
+// Trigger of the --trace-flight recorder. The spec is a comma separated list
+// of conditions, any of which fires it (as does SIGUSR1):
+//   frame:N            reaching frame N
+//   c64pc:ADDR         C64 CPU executing ADDR (hex)
+//   c1541pc:ADDR       C1541 CPU executing ADDR (hex)
+//   c64write:ADDR      C64 CPU writing ADDR (hex)
+//   c1541write:ADDR    C1541 CPU writing ADDR (hex)
+//   iec_atn:V, iec_clock:V, iec_data:V  IEC line changing to V
+class TraceRTLTrigger {
+public:
+  TraceRTLTrigger(const std::string &spec) {
+    std::stringstream ss(spec);
+    std::string item;
+    try {
+      while (std::getline(ss, item, ',')) {
+        auto colon = item.find(':');
+        if (colon == std::string::npos)
+          throw std::invalid_argument(item);
+        auto kind = item.substr(0, colon);
+        auto val = item.substr(colon + 1);
+        if (kind == "frame") {
+          uint32_t frame = std::stoul(val);
+          conds_.push_back([frame] { return g_frame_idx == frame; });
+        } else if (kind == "c64pc" || kind == "c1541pc") {
+          uint16_t addr = std::stoul(val, nullptr, 16);
+          bool c64 = kind == "c64pc";
+          conds_.push_back([addr, c64] {
+            return c64 ? dut->debug_c64_cpu_valid && dut->debug_c64_cpu_sync &&
+                             dut->debug_c64_cpu_addr == addr
+                       : dut->debug_c1541_cpu_valid &&
+                             dut->debug_c1541_cpu_sync &&
+                             dut->debug_c1541_cpu_addr == addr;
+          });
+        } else if (kind == "c64write" || kind == "c1541write") {
+          uint16_t addr = std::stoul(val, nullptr, 16);
+          bool c64 = kind == "c64write";
+          conds_.push_back([addr, c64] {
+            return c64 ? dut->debug_c64_cpu_valid && dut->debug_c64_cpu_we &&
+                             dut->debug_c64_cpu_addr == addr
+                       : dut->debug_c1541_cpu_valid &&
+                             dut->debug_c1541_cpu_we &&
+                             dut->debug_c1541_cpu_addr == addr;
+          });
+        } else if (kind == "iec_atn" || kind == "iec_clock" ||
+                   kind == "iec_data") {
+          const uint8_t &line = kind == "iec_atn"     ? dut->debug_iec_atn
+                                : kind == "iec_clock" ? dut->debug_iec_clock
+                                                      : dut->debug_iec_data;
+          uint8_t v = std::stoul(val);
+          auto prev = std::make_shared<uint8_t>(line);
+          conds_.push_back([&line, v, prev] {
+            bool fire = line == v && *prev != v;
+            *prev = line;
+            return fire;
+          });
+        } else {
+          throw std::invalid_argument(item);
+        }
+      }
+    } catch (const std::logic_error &) {
+      std::cerr << "Bad trace trigger '" << spec << "'\n";
+      exit(1);
+    }
+  }
+  bool Check() {
+    bool fire = false;
+    // Conditions are only sampled on CPU cycles, which is when all of them
+    // can change. All are evaluated to keep edge detection up to date.
+    if (!conds_.empty() &&
+        (dut->debug_c64_cpu_valid || dut->debug_c1541_cpu_valid)) {
+      for (auto &c : conds_)
+        fire |= c();
+    }
+    if (g_sigusr1) {
+      g_sigusr1 = 0;
+      fire = true;
+    }
+    return fire;
+  }
+
+private:
+  std::vector<std::function<bool()>> conds_;
+};
+
 class TraceRTL {
 public:
+  // With flight_frames > 0 the trace goes into one temporary segment file per
+  // frame of which only the last flight_frames are kept. When the trigger
+  // fires, post_frames more frames are recorded and the kept segments are
+  // moved to <out_path minus .fst>-<trigger #>-<segment #>.fst.
+  //
+  // With on_demand the trace is instead started by SIGUSR1 (or creating
+  // control_path) and stopped by SIGUSR2 (or removing control_path), each
+  // capture going to <out_path minus .fst>-<capture #>.fst. The model is not
+  // hooked up to the trace until the first capture starts.
   TraceRTL(const std::string &out_path, const std::vector<std::string> &modules,
-           uint32_t begin_frame)
-      : begin_frame_(begin_frame) {
+           uint32_t begin_frame, uint32_t flight_frames = 0,
+           uint32_t post_frames = 0, const std::string &trigger = "",
+           bool on_demand = false, const std::string &control_path = "")
+      : out_path_(out_path), begin_frame_(begin_frame),
+        flight_frames_(flight_frames), post_frames_(post_frames),
+        on_demand_(on_demand), control_path_(control_path) {
     trace = new VerilatedFstC;
     trace->set_time_unit("1ps");
     trace->set_time_resolution("1ps");
     for (auto &module : modules) {
       trace->dumpvars(1, module);
     }
+    if (on_demand_) {
+      signal(SIGUSR1, [](int) { g_sigusr1 = 1; });
+      signal(SIGUSR2, [](int) { g_sigusr2 = 1; });
+      return;
+    }
     dut->trace(trace, 99);
-    trace->open(out_path.c_str());
+    if (flight_frames_ == 0) {
+      trace->open(out_path.c_str());
+      return;
+    }
+    trigger_ = std::make_unique<TraceRTLTrigger>(trigger);
+    // Segments are kept in memory (tmpfs) when possible, so that only the
+    // dumped ones ever hit the disk
+    struct stat st;
+    std::string tmpl = stat("/dev/shm", &st) == 0 && S_ISDIR(st.st_mode)
+                           ? "/dev/shm/core_top-sim-flight-XXXXXX"
+                           : out_path + ".flight-XXXXXX";
+    if (!mkdtemp(&tmpl[0])) {
+      std::cerr << "Unable to create '" << tmpl << "'\n";
+      exit(1);
+    }
+    segment_dir_ = tmpl;
+    signal(SIGUSR1, [](int) { g_sigusr1 = 1; });
+  }
+  ~TraceRTL() {
+    // A capture cut short by the end of the simulation is still written, with
+    // what there is of the post-trigger frames
+    if (triggered_ && trace->isOpen())
+      Dump();
+    if (trace->isOpen())
+      trace->close();
+    for (auto &seg : segments_)
+      unlink(seg.c_str());
+    if (!segment_dir_.empty())
+      rmdir(segment_dir_.c_str());
+    delete trace;
   }
   void Tick() {
-    if (g_frame_idx >= begin_frame_) {
+    if (on_demand_) {
+      OnDemandTick();
+      return;
+    }
+    if (g_frame_idx < begin_frame_)
+      return;
+    if (flight_frames_ == 0) {
       trace->dump(g_ticks);
       if (g_frame_idx > last_flush_frame_) {
         trace->flush();
         last_flush_frame_ = g_frame_idx;
       }
+      return;
+    }
+    if (!trace->isOpen() || g_frame_idx != segment_frame_) {
+      if (triggered_ && g_frame_idx - trigger_frame_ > post_frames_)
+        Dump();
+      NextSegment();
+    }
+    if (!triggered_ && trigger_->Check()) {
+      triggered_ = true;
+      trigger_frame_ = g_frame_idx;
+      printf("trace-flight: trigger at frame=%u, ticks=%lu\n", g_frame_idx,
+             g_ticks);
+    }
+    trace->dump(g_ticks);
+  }
+
+private:
+  void OnDemandTick() {
+    bool start = g_sigusr1;
+    bool stop = g_sigusr2;
+    g_sigusr1 = g_sigusr2 = 0;
+    // Control file is only looked at once per frame
+    if (!control_path_.empty() && g_frame_idx != control_frame_) {
+      control_frame_ = g_frame_idx;
+      bool exists = access(control_path_.c_str(), F_OK) == 0;
+      start |= exists && !trace->isOpen();
+      stop |= !exists && trace->isOpen();
+    }
+    if (start && !trace->isOpen()) {
+      if (!traced_) {
+        dut->trace(trace, 99);
+        traced_ = true;
+      }
+      char suffix[32];
+      snprintf(suffix, sizeof(suffix), "-%u.fst", num_dumps_++);
+      std::string path = BasePath() + suffix;
+      trace->open(path.c_str());
+      printf("trace: start frame=%u, ticks=%lu, path=%s\n", g_frame_idx,
+             g_ticks, path.c_str());
+    } else if (stop && trace->isOpen()) {
+      trace->close();
+      printf("trace: stop frame=%u, ticks=%lu\n", g_frame_idx, g_ticks);
+    }
+    if (trace->isOpen())
+      trace->dump(g_ticks);
+  }
+  std::string BasePath() const {
+    std::string base = out_path_;
+    if (base.size() > 4 && base.compare(base.size() - 4, 4, ".fst") == 0)
+      base.resize(base.size() - 4);
+    return base;
+  }
+  void NextSegment() {
+    if (trace->isOpen()) {
+      trace->close();
+      segments_.push_back(segment_path_);
+    }
+    // Keep the segment that is about to be written on top of flight_frames_
+    while (segments_.size() >= flight_frames_ + (triggered_ ? post_frames_ : 0)) {
+      unlink(segments_.front().c_str());
+      segments_.pop_front();
+    }
+    segment_frame_ = g_frame_idx;
+    segment_path_ =
+        segment_dir_ + "/" + std::to_string(segment_frame_) + ".fst";
+    trace->open(segment_path_.c_str());
+  }
+  // Rename, or copy when 'from' is on another file system (tmpfs)
+  static void MoveFile(const std::string &from, const std::string &to) {
+    if (rename(from.c_str(), to.c_str()) == 0 || errno != EXDEV)
+      return;
+    std::ifstream is(from, std::ios::binary);
+    std::ofstream os(to, std::ios::binary);
+    os << is.rdbuf();
+    if (!os)
+      std::cerr << "Unable to write '" << to << "'\n";
+    unlink(from.c_str());
+  }
+  // Move the kept segments (the current one included) to their final names
+  void Dump() {
+    trace->close();
+    segments_.push_back(segment_path_);
+    std::string base = BasePath();
+    unsigned idx = 0;
+    for (auto &seg : segments_) {
+      char suffix[32];
+      snprintf(suffix, sizeof(suffix), "-%u-%03u.fst", num_dumps_, idx++);
+      MoveFile(seg, base + suffix);
+    }
+    printf("trace-flight: wrote %s-%u-*.fst (%u segments)\n", base.c_str(),
+           num_dumps_, idx);
+    segments_.clear();
+    num_dumps_++;
+    triggered_ = false;
+  }
+
+  VerilatedFstC *trace;
+  std::string out_path_;
+  uint32_t begin_frame_;
+  uint32_t last_flush_frame_ = 0;
+  // Flight recorder
+  uint32_t flight_frames_;
+  uint32_t post_frames_;
+  std::unique_ptr<TraceRTLTrigger> trigger_;
+  std::string segment_dir_;
+  std::string segment_path_;
+  uint32_t segment_frame_ = 0;
+  std::deque<std::string> segments_;
+  bool triggered_ = false;
+  uint32_t trigger_frame_ = 0;
+  unsigned num_dumps_ = 0;
+  // On demand
+  bool on_demand_;
+  std::string control_path_;
+  uint32_t control_frame_ = ~0u;
+  bool traced_ = false;
+};
+
+// Encodes frames to .png on a pool of worker threads. Frames are handed over
+// through a bounded queue, Push() only blocks when the queue is full.
+#if SIM_HEADLESS
+static void PngChunk(FILE *fp, const char *type, const uint8_t *data,
+                     uint32_t len) {
+  uint8_t be[4] = {uint8_t(len >> 24), uint8_t(len >> 16), uint8_t(len >> 8),
+                   uint8_t(len)};
+  fwrite(be, 1, 4, fp);
+  fwrite(type, 1, 4, fp);
+  fwrite(data, 1, len, fp);
+  uint32_t crc = crc32(0, reinterpret_cast<const Bytef *>(type), 4);
+  if (len) // crc32() with a null buffer returns the initial value
+    crc = crc32(crc, data, len);
+  uint8_t crc_be[4] = {uint8_t(crc >> 24), uint8_t(crc >> 16),
+                       uint8_t(crc >> 8), uint8_t(crc)};
+  fwrite(crc_be, 1, 4, fp);
+}
+
+// Minimal 8-bit RGB .png writer (no filtering)
+static void WritePng(const std::string &path, const std::vector<uint8_t> &rgb,
+                     unsigned width, unsigned height) {
+  FILE *fp = fopen(path.c_str(), "wb");
+  if (!fp) {
+    std::cerr << "Unable to open '" << path << "'\n";
+    return;
+  }
+  static const uint8_t sig[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  fwrite(sig, 1, sizeof(sig), fp);
+
+  uint8_t ihdr[13] = {uint8_t(width >> 24),  uint8_t(width >> 16),
+                      uint8_t(width >> 8),   uint8_t(width),
+                      uint8_t(height >> 24), uint8_t(height >> 16),
+                      uint8_t(height >> 8),  uint8_t(height),
+                      8, // Bit depth
+                      2, // Color type RGB
+                      0, 0, 0};
+  PngChunk(fp, "IHDR", ihdr, sizeof(ihdr));
+
+  // Each scanline is prefixed by its filter type (0 = none)
+  size_t stride = width * 3;
+  std::vector<uint8_t> raw((stride + 1) * height);
+  for (unsigned y = 0; y < height; y++) {
+    raw[y * (stride + 1)] = 0;
+    memcpy(&raw[y * (stride + 1) + 1], &rgb[y * stride], stride);
+  }
+  uLongf len = compressBound(raw.size());
+  std::vector<uint8_t> idat(len);
+  compress2(idat.data(), &len, raw.data(), raw.size(), Z_DEFAULT_COMPRESSION);
+  PngChunk(fp, "IDAT", idat.data(), len);
+  PngChunk(fp, "IEND", nullptr, 0);
+  fclose(fp);
+}
+#endif
+
+class PngEncoderPool {
+public:
+  PngEncoderPool(unsigned num_threads, unsigned width, unsigned height)
+      : width_(width), height_(height), max_queued_(2 * num_threads) {
+    for (unsigned i = 0; i < num_threads; i++)
+      workers_.emplace_back([this] { Worker(); });
+  }
+  ~PngEncoderPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    not_empty_.notify_all();
+    for (auto &w : workers_)
+      w.join();
+  }
+  void Push(const std::string &path, const std::vector<uint8_t> &rgb) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this] { return queue_.size() < max_queued_; });
+    queue_.emplace_back(path, rgb);
+    lock.unlock();
+    not_empty_.notify_one();
+  }
+
+private:
+  void Worker() {
+    for (;;) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      not_empty_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+      if (queue_.empty())
+        return; // Stopped and drained
+      auto job = std::move(queue_.front());
+      queue_.pop_front();
+      lock.unlock();
+      not_full_.notify_one();
+
+#if SIM_HEADLESS
+      WritePng(job.first, job.second, width_, height_);
+#else
+      GdkPixbuf *pixbuf = gdk_pixbuf_new_from_data(
+          job.second.data(), GDK_COLORSPACE_RGB, FALSE, 8, width_, height_,
+          width_ * 3, NULL, NULL);
+      gdk_pixbuf_save(pixbuf, job.first.c_str(), "png", NULL, NULL);
+      g_object_unref(pixbuf);
+#endif
+    }
+  }
+
+  unsigned width_;
+  unsigned height_;
+  size_t max_queued_;
+  std::vector<std::thread> workers_;
+  std::deque<std::pair<std::string, std::vector<uint8_t>>> queue_;
+  std::mutex mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+  bool stop_ = false;
+};
+
+// Rebuilds the visible part of the frame from the video outputs of the model
+// and hands the completed frame (packed RGB) to the registered sinks at vsync.
+class VideoCapture {
+public:
+  static constexpr unsigned c_Xres = 504;
+  static constexpr unsigned c_Yres = 312;
+  using Sink = std::function<void(const std::vector<uint8_t> &)>;
+
+  VideoCapture() : m_Frame(c_Xres * c_Yres * 3, 0) {}
+  void AddSink(Sink sink) { m_Sinks.push_back(sink); }
+  void Tick() {
+    bool FrameDone = false;
+
+    if (dut->video_hs) {
+      m_HCntr = 0;
+      m_VCntr++;
+    }
+    if (dut->video_vs) {
+      m_VCntr = 0;
+      FrameDone = true;
+    }
+
+    unsigned m_HCntrShifted = m_HCntr - 70;
+    unsigned m_VCntrShifted = m_VCntr - 10;
+    if (m_HCntrShifted < c_Xres && m_VCntrShifted < c_Yres) {
+      uint8_t *p = &m_Frame[(m_VCntrShifted * c_Xres + m_HCntrShifted) * 3];
+      p[0] = dut->video_rgb >> 16;
+      p[1] = dut->video_rgb >> 8;
+      p[2] = dut->video_rgb & 0xff;
+    }
+
+    m_HCntr++;
+
+    if (FrameDone) {
+      for (auto &sink : m_Sinks)
+        sink(m_Frame);
+    }
+  }
+  template <typename F> void VisitState(F &&f) {
+    f(m_HCntr);
+    f(m_VCntr);
+  }
+
+private:
+  std::vector<uint8_t> m_Frame; // Not cleared in between frames
+  std::vector<Sink> m_Sinks;
+  unsigned m_HCntr = 0;
+  unsigned m_VCntr = 0;
+};
+
+class FrameDumper {
+public:
+  // Dump every frame unless given a set of frames to dump
+  FrameDumper(unsigned num_threads, const std::vector<uint32_t> &frames)
+      : m_Encoder(num_threads, VideoCapture::c_Xres, VideoCapture::c_Yres),
+        m_Frames(frames.begin(), frames.end()) {}
+  void Frame(const std::vector<uint8_t> &rgb) {
+    if (!m_Frames.empty() && !m_Frames.count(g_frame_idx))
+      return;
+    char buf[32];
+    snprintf(buf, sizeof(buf), "vicii-%04d.png", g_frame_idx);
+    m_Encoder.Push(buf, rgb);
+    printf("%s\n", buf);
+  }
+
+private:
+  PngEncoderPool m_Encoder;
+  std::set<uint32_t> m_Frames;
+};
+
+// Streams frames as raw RGB24 or YUV4MPEG2 (4:4:4) to a file or to stdout
+// ('-'), in which case regular output is moved over to stderr.
+class VideoStream {
+public:
+  enum class Format { RGB24, Y4M };
+
+  VideoStream(const std::string &path, Format format) : format_(format) {
+    int fd;
+    if (path == "-") {
+      fflush(stdout);
+      fd = dup(STDOUT_FILENO);
+      dup2(STDERR_FILENO, STDOUT_FILENO);
+    } else {
+      fd = AsyncSink::Open(path);
+    }
+    // Room for a few frames
+    sink_ = std::make_unique<AsyncSink>(fd, path, 4 << 20);
+    fp_ = sink_->File();
+    setvbuf(fp_, nullptr, _IOFBF, 1 << 20);
+    if (format_ == Format::Y4M) {
+      fprintf(fp_, "YUV4MPEG2 W%u H%u F50:1 Ip A1:1 C444\n",
+              VideoCapture::c_Xres, VideoCapture::c_Yres);
+      planes_.resize(VideoCapture::c_Xres * VideoCapture::c_Yres * 3);
+    }
+  }
+  void Frame(const std::vector<uint8_t> &rgb) {
+    if (format_ == Format::RGB24) {
+      fwrite(rgb.data(), 1, rgb.size(), fp_);
+      return;
+    }
+    // BT.601 limited range
+    size_t num_pixels = rgb.size() / 3;
+    uint8_t *y = &planes_[0];
+    uint8_t *u = &planes_[num_pixels];
+    uint8_t *v = &planes_[2 * num_pixels];
+    for (size_t i = 0; i < num_pixels; i++) {
+      int r = rgb[3 * i + 0], g = rgb[3 * i + 1], b = rgb[3 * i + 2];
+      y[i] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+      u[i] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+      v[i] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+    }
+    fputs("FRAME\n", fp_);
+    fwrite(planes_.data(), 1, planes_.size(), fp_);
+  }
+
+private:
+  std::unique_ptr<AsyncSink> sink_;
+  FILE *fp_;
+  Format format_;
+  std::vector<uint8_t> planes_;
+};
+
+// Hashes each completed frame (FNV-1a, 64-bit) so that runs can be compared
+// frame by frame without encoding any images.
+class FrameHash {
+public:
+  FrameHash(const std::string &path,
+            const std::vector<std::string> &expect) {
+    if (!path.empty()) {
+      fp_ = fopen(path.c_str(), "w");
+      if (!fp_) {
+        std::cerr << "Unable to open '" << path << "'\n";
+        exit(1);
+      }
+    }
+    for (auto &e : expect) {
+      unsigned frame;
+      unsigned long long hash;
+      if (sscanf(e.c_str(), "%u:%llx", &frame, &hash) != 2) {
+        std::cerr << "Bad --expect-hash '" << e << "', expected FRAME:HASH\n";
+        exit(1);
+      }
+      expect_[frame] = hash;
+    }
+  }
+  ~FrameHash() {
+    if (fp_)
+      fclose(fp_);
+  }
+  void Frame(const std::vector<uint8_t> &rgb) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (uint8_t b : rgb) {
+      hash ^= b;
+      hash *= 0x100000001b3ull;
+    }
+    if (fp_)
+      fprintf(fp_, "%04u %016lx\n", g_frame_idx, hash);
+    auto it = expect_.find(g_frame_idx);
+    if (it != expect_.end()) {
+      if (it->second != hash) {
+        fprintf(stderr, "frame-hash: frame %u mismatch, got %016lx expected "
+                        "%016lx\n",
+                g_frame_idx, hash, it->second);
+        failed_ = true;
+      }
+      expect_.erase(it);
+    }
+  }
+  // True if all expected hashes were seen and matched
+  bool Check() const {
+    for (auto &e : expect_)
+      fprintf(stderr, "frame-hash: frame %u never reached\n", e.first);
+    return !failed_ && expect_.empty();
+  }
+
+private:
+  FILE *fp_ = nullptr;
+  std::map<unsigned, uint64_t> expect_;
+  bool failed_ = false;
+};
+
+// IEC bus lines sampled at 1 MHz, either every sample as .csv or only the
+// transitions as .vcd (loads directly into PulseView/GTKWave).
+class TraceIEC {
+public:
+  enum class Format { CSV, VCD };
+
+  TraceIEC(std::string &path, uint32_t begin_frame, Format format)
+      : begin_frame_(begin_frame), format_(format) {
+    sink_ = std::make_unique<AsyncSink>(AsyncSink::Open(path), path);
+    fp_ = sink_->File();
+    if (format_ == Format::CSV) {
+      fprintf(fp_, "atn,clk,dat\n");
+    } else {
+      fprintf(fp_, "$timescale 1ps $end\n"
+                   "$scope module iec $end\n"
+                   "$var wire 1 a atn $end\n"
+                   "$var wire 1 c clk $end\n"
+                   "$var wire 1 d dat $end\n"
+                   "$upscope $end\n"
+                   "$enddefinitions $end\n");
+    }
+  }
+  void Tick() {
+    if (g_frame_idx >= begin_frame_ && dut->debug_1mhz_ph1_en) {
+      if (format_ == Format::CSV) {
+        fprintf(fp_, "%d,%d,%d\n", dut->debug_iec_atn, dut->debug_iec_clock,
+                dut->debug_iec_data);
+        return;
+      }
+      uint8_t lines = dut->debug_iec_atn | dut->debug_iec_clock << 1 |
+                      dut->debug_iec_data << 2;
+      if (started_ && lines == prev_lines_)
+        return;
+      // One tick is 15625 ps
+      fprintf(fp_, "#%lu\n", g_ticks * 15625);
+      static const char ids[3] = {'a', 'c', 'd'};
+      if (!started_) {
+        // Initial values of all lines
+        fprintf(fp_, "$dumpvars\n");
+        for (unsigned i = 0; i < 3; i++)
+          fprintf(fp_, "%u%c\n", lines >> i & 1, ids[i]);
+        fprintf(fp_, "$end\n");
+        started_ = true;
+      } else {
+        for (unsigned i = 0; i < 3; i++) {
+          if ((lines ^ prev_lines_) >> i & 1)
+            fprintf(fp_, "%u%c\n", lines >> i & 1, ids[i]);
+        }
+      }
+      prev_lines_ = lines;
+    }
+  }
+
+private:
+  std::unique_ptr<AsyncSink> sink_;
+  FILE *fp_;
+  uint32_t begin_frame_;
+  Format format_;
+  bool started_ = false; // Initial values written
+  uint8_t prev_lines_ = 0;
+};
+
+// Decodes the IEC serial protocol from the bus lines (1 = released) sampled
+// at 1 MHz. Logs ATN commands and data transfers and, by Report(), load
+// throughput per opened file and the time spent in each protocol phase.
+class IECDecoder {
+public:
+  IECDecoder(const std::string &path) {
+    sink_ = std::make_unique<AsyncSink>(AsyncSink::Open(path), path);
+    fp_ = sink_->File();
+  }
+  void Tick() {
+    if (!dut->debug_1mhz_ph1_en)
+      return;
+    bool atn = dut->debug_iec_atn;
+    bool clk = dut->debug_iec_clock;
+    bool dat = dut->debug_iec_data;
+
+    uint64_t delta = g_ticks - last_ticks_;
+    last_ticks_ = g_ticks;
+    state_ticks_[int(state_)] += delta;
+    mode_ticks_[int(under_atn_ ? Mode::Atn : mode_)] += delta;
+
+    if (atn != prev_atn_) {
+      // Talker and listener start over when ATN changes
+      FlushData(false);
+      under_atn_ = !atn;
+      state_ = State::TalkerBusy;
+    }
+    bool clk_rise = clk && !prev_clk_, clk_fall = !clk && prev_clk_;
+    bool dat_rise = dat && !prev_dat_, dat_fall = !dat && prev_dat_;
+    switch (state_) {
+    case State::TalkerBusy:
+      // Talker releases CLK when ready to send
+      if (clk_rise)
+        state_ = State::ListenerBusy;
+      break;
+    case State::ListenerBusy:
+      // Listener releases DATA when ready for data
+      if (dat_rise) {
+        state_ = State::Ready;
+        eoi_ = false;
+      } else if (clk_fall) {
+        state_ = State::TalkerBusy;
+      }
+      break;
+    case State::Ready:
+      // Talker holding back signals EOI, acknowledged by a DATA pulse
+      if (dat_fall && clk) {
+        state_ = State::Eoi;
+      } else if (clk_fall) {
+        state_ = State::Bits;
+        bits_ = 0;
+        byte_ = 0;
+      }
+      break;
+    case State::Eoi:
+      if (dat_rise) {
+        state_ = State::Ready;
+        eoi_ = true;
+      }
+      break;
+    case State::Bits:
+      // LSB first, valid while CLK is released
+      if (clk_rise) {
+        byte_ |= dat << bits_;
+        if (++bits_ == 8) {
+          Byte(byte_, eoi_);
+          state_ = State::TalkerBusy;
+        }
+      }
+      break;
     }
+    prev_atn_ = atn;
+    prev_clk_ = clk;
+    prev_dat_ = dat;
+  }
+  void Report() {
+    FlushData(false);
+    for (auto &it : open_files_)
+      CloseFile(it.second);
+    open_files_.clear();
+
+    auto report = [&](FILE *fp) {
+      for (auto &f : files_) {
+        double secs = (f.close_ticks - f.open_ticks) / TICKS_PER_SECOND;
+        double xfer_secs = (f.last_ticks - f.first_ticks) / TICKS_PER_SECOND;
+        fprintf(fp,
+                "iec: file \"%s\" %u:%u, %lu bytes read in %.3fs (%.1f B/s), "
+                "first to last byte %.3fs (%.1f B/s)\n",
+                f.name.c_str(), f.device, f.channel, f.bytes, secs,
+                secs > 0 ? f.bytes / secs : 0.0, xfer_secs,
+                xfer_secs > 0 ? f.bytes / xfer_secs : 0.0);
+      }
+      auto phase = [&](const char *name, uint64_t ticks) {
+        fprintf(fp, "iec: %-14s %10.3fs\n", name, ticks / TICKS_PER_SECOND);
+      };
+      phase("atn", mode_ticks_[int(Mode::Atn)]);
+      phase("listen", mode_ticks_[int(Mode::Listen)]);
+      phase("talk", mode_ticks_[int(Mode::Talk)]);
+      phase("idle", mode_ticks_[int(Mode::Idle)]);
+      phase("talker-busy", state_ticks_[int(State::TalkerBusy)]);
+      phase("listener-busy", state_ticks_[int(State::ListenerBusy)]);
+      phase("ready", state_ticks_[int(State::Ready)]);
+      phase("eoi", state_ticks_[int(State::Eoi)]);
+      phase("bits", state_ticks_[int(State::Bits)]);
+    };
+    report(fp_);
+    report(stdout);
   }
 
 private:
-  VerilatedFstC *trace;
-  uint32_t begin_frame_;
-  uint32_t last_flush_frame_ = 0;
-};
+  enum class State { TalkerBusy, ListenerBusy, Ready, Eoi, Bits };
+  enum class Mode { Idle, Listen, Talk, Atn };
+  static constexpr int c_NumStates = 5;
+  static constexpr int c_NumModes = 4;
+  struct File {
+    std::string name;
+    unsigned device;
+    unsigned channel;
+    uint64_t bytes = 0;
+    uint64_t open_ticks = 0;
+    uint64_t close_ticks = 0;
+    uint64_t first_ticks = 0;
+    uint64_t last_ticks = 0;
+  };
 
-class FrameDumper {
-public:
-  FrameDumper() {
-    m_FramePixBuf =
-        gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, c_Xres, c_Yres);
-    gdk_pixbuf_fill(m_FramePixBuf, 0);
+  void Byte(uint8_t b, bool eoi) {
+    if (under_atn_) {
+      Command(b);
+      return;
+    }
+    if (data_.empty())
+      data_ticks_ = g_ticks;
+    data_.push_back(b);
+    if (eoi)
+      FlushData(true);
   }
-  void Tick() {
-    bool FrameDone = false;
-
-    if (dut->video_hs) {
-      m_HCntr = 0;
-      m_VCntr++;
+  void Command(uint8_t b) {
+    FlushData(false);
+    fprintf(fp_, "%.6f ", g_ticks / TICKS_PER_SECOND);
+    if (b == 0x3f) {
+      fprintf(fp_, "UNLISTEN\n");
+      mode_ = Mode::Idle;
+    } else if (b == 0x5f) {
+      fprintf(fp_, "UNTALK\n");
+      mode_ = Mode::Idle;
+    } else if ((b & 0xe0) == 0x20) {
+      device_ = b & 0x1f;
+      fprintf(fp_, "LISTEN %u\n", device_);
+      mode_ = Mode::Listen;
+    } else if ((b & 0xe0) == 0x40) {
+      device_ = b & 0x1f;
+      fprintf(fp_, "TALK %u\n", device_);
+      mode_ = Mode::Talk;
+    } else if ((b & 0xf0) == 0x60) {
+      channel_ = b & 0x0f;
+      fprintf(fp_, "SECOND %u\n", channel_);
+    } else if ((b & 0xf0) == 0xe0) {
+      channel_ = b & 0x0f;
+      fprintf(fp_, "CLOSE %u\n", channel_);
+      auto it = open_files_.find(device_ << 4 | channel_);
+      if (it != open_files_.end()) {
+        CloseFile(it->second);
+        open_files_.erase(it);
+      }
+    } else if ((b & 0xf0) == 0xf0) {
+      channel_ = b & 0x0f;
+      fprintf(fp_, "OPEN %u\n", channel_);
+      opening_ = true;
+    } else {
+      fprintf(fp_, "ATN $%02X\n", b);
     }
-    if (dut->video_vs) {
-      m_VCntr = 0;
-      FrameDone = true;
+  }
+  // Log the data received since the last command or EOI
+  void FlushData(bool eoi) {
+    if (data_.empty())
+      return;
+    fprintf(fp_, "%.6f ", data_ticks_ / TICKS_PER_SECOND);
+    if (opening_) {
+      // Data following OPEN is the file name
+      File f;
+      f.name.assign(data_.begin(), data_.end());
+      f.device = device_;
+      f.channel = channel_;
+      f.open_ticks = data_ticks_;
+      open_files_[device_ << 4 | channel_] = f;
+      fprintf(fp_, "NAME \"%s\"\n", f.name.c_str());
+      opening_ = false;
+    } else {
+      fprintf(fp_, "%s %zu bytes%s:", mode_ == Mode::Talk ? "<-" : "->",
+              data_.size(), eoi ? " EOI" : "");
+      for (size_t i = 0; i < std::min<size_t>(data_.size(), 16); i++)
+        fprintf(fp_, " %02X", data_[i]);
+      fprintf(fp_, data_.size() > 16 ? " ...\n" : "\n");
+      auto it = open_files_.find(device_ << 4 | channel_);
+      if (mode_ == Mode::Talk && it != open_files_.end()) {
+        File &f = it->second;
+        if (f.bytes == 0)
+          f.first_ticks = data_ticks_;
+        f.bytes += data_.size();
+        f.last_ticks = g_ticks;
+      }
     }
+    data_.clear();
+  }
+  void CloseFile(File &f) {
+    f.close_ticks = g_ticks;
+    files_.push_back(f);
+  }
 
-    unsigned m_HCntrShifted = m_HCntr - 70;
-    unsigned m_VCntrShifted = m_VCntr - 10;
-    if (0 <= m_HCntrShifted && m_HCntrShifted < c_Xres && 0 <= m_VCntrShifted &&
-        m_VCntrShifted < c_Yres) {
-      guchar Red = dut->video_rgb >> 16;
-      guchar Green = dut->video_rgb >> 8;
-      guchar Blue = dut->video_rgb & 0xff;
-      PutPixel(m_FramePixBuf, m_HCntrShifted, m_VCntrShifted, Red, Green, Blue);
-    }
+  std::unique_ptr<AsyncSink> sink_;
+  FILE *fp_;
+  bool prev_atn_ = true;
+  bool prev_clk_ = true;
+  bool prev_dat_ = true;
+  bool under_atn_ = false;
+  State state_ = State::TalkerBusy;
+  Mode mode_ = Mode::Idle;
+  unsigned bits_ = 0;
+  uint8_t byte_ = 0;
+  bool eoi_ = false;
+  unsigned device_ = 0;
+  unsigned channel_ = 0;
+  bool opening_ = false;
+  std::vector<uint8_t> data_;
+  uint64_t data_ticks_ = 0;
+  std::map<unsigned, File> open_files_;
+  std::vector<File> files_;
+  uint64_t last_ticks_ = 0;
+  uint64_t state_ticks_[c_NumStates] = {};
+  uint64_t mode_ticks_[c_NumModes] = {};
+};
 
-    m_HCntr++;
+// Streaming rational resampler from the 1 MHz SID sample rate to 48 kHz (up by
+// 6, down by 125). The anti-aliasing filter is a Kaiser windowed sinc at the
+// 6 MHz intermediate rate, split into one phase per upsampling offset so that
+// each output sample is a single dot product over the input history.
+class AudioResampler {
+public:
+  static constexpr unsigned c_Up = 6;
+  static constexpr unsigned c_Down = 125;
+  static constexpr unsigned c_TapsPerPhase = 1024;
 
-    if (FrameDone) {
-      char buf[32];
-      snprintf(buf, sizeof(buf), "vicii-%04d.png", g_frame_idx);
-      gdk_pixbuf_save(m_FramePixBuf, buf, "png", NULL, NULL);
-      printf("%s\n", buf);
+  AudioResampler() : coeffs_(c_Up * c_TapsPerPhase), hist_(2 * c_TapsPerPhase) {
+    // Pass band up to about 18 kHz, at least 80 dB down from 23.5 kHz
+    const unsigned n = c_Up * c_TapsPerPhase;
+    const double fc = 21000.0 / (c_Up * 1000000.0);
+    const double beta = 8.0;
+    for (unsigned i = 0; i < n; i++) {
+      double x = i - (n - 1) / 2.0;
+      double sinc = x == 0 ? 2 * fc : sin(2 * M_PI * fc * x) / (M_PI * x);
+      double r = 2.0 * i / (n - 1) - 1;
+      double w = BesselI0(beta * sqrt(1 - r * r)) / BesselI0(beta);
+      // Phase p holds taps p, p + Up, ... reversed to match the history order
+      unsigned p = i % c_Up, j = i / c_Up;
+      coeffs_[p * c_TapsPerPhase + c_TapsPerPhase - 1 - j] = c_Up * sinc * w;
     }
   }
 
-private:
-  void PutPixel(GdkPixbuf *pixbuf, int x, int y, guchar red, guchar green,
-                guchar blue) {
-    int width, height, rowstride, n_channels;
-    guchar *pixels, *p;
-
-    n_channels = gdk_pixbuf_get_n_channels(pixbuf);
+  // Push one input sample, calls out(y) for each output sample it completes
+  template <typename F> void Push(float x, F &&out) {
+    unsigned pos = in_idx_ % c_TapsPerPhase;
+    // Stored twice so that the last c_TapsPerPhase inputs are contiguous
+    hist_[pos] = hist_[pos + c_TapsPerPhase] = x;
+    while (next_ / c_Up <= in_idx_) {
+      const float *c = &coeffs_[(next_ % c_Up) * c_TapsPerPhase];
+      const float *h = &hist_[pos + 1];
+      float y = 0;
+      for (unsigned i = 0; i < c_TapsPerPhase; i++)
+        y += c[i] * h[i];
+      out(y);
+      next_ += c_Down;
+    }
+    in_idx_++;
+  }
 
-    g_assert(gdk_pixbuf_get_colorspace(pixbuf) == GDK_COLORSPACE_RGB);
-    g_assert(gdk_pixbuf_get_bits_per_sample(pixbuf) == 8);
-    g_assert(!gdk_pixbuf_get_has_alpha(pixbuf));
-    g_assert(n_channels == 3);
+private:
+  static double BesselI0(double x) {
+    double sum = 1, term = 1;
+    for (unsigned k = 1; term > 1e-12 * sum; k++) {
+      term *= (x / (2 * k)) * (x / (2 * k));
+      sum += term;
+    }
+    return sum;
+  }
 
-    width = gdk_pixbuf_get_width(pixbuf);
-    height = gdk_pixbuf_get_height(pixbuf);
+  std::vector<float> coeffs_;
+  std::vector<float> hist_;
+  uint64_t in_idx_ = 0;
+  uint64_t next_ = 0; // Next output in 6 MHz samples
+};
 
-    g_assert(x >= 0 && x < width);
-    g_assert(y >= 0 && y < height);
+// SID output sampled at 1 MHz, resampled to 48 kHz and written as 16-bit mono
+// .wav (--dump-audio). The sizes in the .wav header are only filled in at
+// exit, until then (or when writing to a pipe) they are left at max.
+class AudioCapture {
+public:
+  static constexpr uint32_t c_Rate = 48000;
 
-    rowstride = gdk_pixbuf_get_rowstride(pixbuf);
-    pixels = gdk_pixbuf_get_pixels(pixbuf);
+  AudioCapture(const std::string &path) {
+    int fd = AsyncSink::Open(path);
+    header_fd_ = dup(fd);
+    sink_ = std::make_unique<AsyncSink>(fd, path);
+    fp_ = sink_->File();
+    auto header = Header(0xffffffff - 36);
+    fwrite(header.data(), 1, header.size(), fp_);
+  }
+  ~AudioCapture() {
+    sink_.reset();
+    auto header = Header(samples_ * 2);
+    if (pwrite(header_fd_, header.data(), header.size(), 0) < 0) {
+      // Not seekable, the header keeps its max sizes
+    }
+    close(header_fd_);
+  }
+  void Tick() {
+    if (!dut->debug_1mhz_ph1_en)
+      return;
+    resampler_.Push(int16_t(dut->debug_sid_wave) / 32768.0f, [this](float y) {
+      int16_t s = std::max(-32768.0f, std::min(32767.0f, roundf(y * 32768)));
+      uint8_t b[2] = {uint8_t(s), uint8_t(s >> 8)};
+      fwrite(b, 1, 2, fp_);
+      for (uint8_t c : b) {
+        hash_ ^= c;
+        hash_ *= 0x100000001b3ull;
+      }
+      samples_++;
+    });
+  }
+  void Report() const {
+    printf("audio: samples=%lu, seconds=%.2f, hash=%016lx\n", samples_,
+           double(samples_) / c_Rate, hash_);
+  }
 
-    p = pixels + y * rowstride + x * n_channels;
-    p[0] = red;
-    p[1] = green;
-    p[2] = blue;
+private:
+  static std::array<uint8_t, 44> Header(uint32_t data_size) {
+    std::array<uint8_t, 44> h;
+    auto put = [&](unsigned off, uint32_t v, unsigned len) {
+      for (unsigned i = 0; i < len; i++)
+        h[off + i] = v >> (8 * i);
+    };
+    memcpy(&h[0], "RIFF", 4);
+    put(4, 36 + data_size, 4);
+    memcpy(&h[8], "WAVEfmt ", 8);
+    put(16, 16, 4);         // fmt chunk size
+    put(20, 1, 2);          // PCM
+    put(22, 1, 2);          // Mono
+    put(24, c_Rate, 4);     // Sample rate
+    put(28, c_Rate * 2, 4); // Byte rate
+    put(32, 2, 2);          // Block align
+    put(34, 16, 2);         // Bits per sample
+    memcpy(&h[36], "data", 4);
+    put(40, data_size, 4);
+    return h;
   }
 
-  const unsigned c_Xres = 504;
-  const unsigned c_Yres = 312;
-  GdkPixbuf *m_FramePixBuf;
-  unsigned m_HCntr = 0;
-  unsigned m_VCntr = 0;
+  std::unique_ptr<AsyncSink> sink_;
+  FILE *fp_;
+  int header_fd_;
+  AudioResampler resampler_;
+  uint64_t samples_ = 0;
+  uint64_t hash_ = 0xcbf29ce484222325ull;
 };
 
-class TraceIEC {
+class SimStats {
 public:
-  TraceIEC(std::string &path, uint32_t begin_frame)
-      : begin_frame_(begin_frame) {
-    fp_ = fopen(path.c_str(), "w");
-    fprintf(fp_, "atn,clk,dat\n");
+  enum Category {
+    Eval,
+    Bridge,
+    FrameDumper,
+    Trace6502,
+    Profile6502,
+    TraceIEC,
+    TraceRTL,
+    Audio,
+    NumCategories
+  };
+  using Clock = std::chrono::steady_clock;
+
+  SimStats(uint32_t interval_frames, const std::string &json_path)
+      : interval_frames_(interval_frames), json_path_(json_path) {
+    start_ = interval_start_ = Clock::now();
+    start_ticks_ = interval_start_ticks_ = g_ticks;
+    start_frame_ = interval_start_frame_ = g_frame_idx;
   }
-  void Tick() {
-    if (g_frame_idx >= begin_frame_ && dut->debug_1mhz_ph1_en) {
-      fprintf(fp_, "%d,%d,%d\n", dut->debug_iec_atn, dut->debug_iec_clock,
-              dut->debug_iec_data);
+  template <typename F> void Measure(Category c, F &&f) {
+    auto t0 = Clock::now();
+    f();
+    host_time_[c] += Clock::now() - t0;
+    if (c == Eval)
+      evals_++;
+  }
+  void Frame() {
+    if (interval_frames_ == 0 ||
+        g_frame_idx - interval_start_frame_ < interval_frames_)
+      return;
+    auto now = Clock::now();
+    double secs = std::chrono::duration<double>(now - interval_start_).count();
+    double ticks = g_ticks - interval_start_ticks_;
+    double frames = g_frame_idx - interval_start_frame_;
+    printf("stats: frame=%u, ticks/s=%.0f, frames/s=%.2f, rtf=%.4f\n",
+           g_frame_idx, ticks / secs, frames / secs,
+           ticks / TICKS_PER_SECOND / secs);
+    interval_start_ = now;
+    interval_start_ticks_ = g_ticks;
+    interval_start_frame_ = g_frame_idx;
+  }
+  void Report() {
+    double secs =
+        std::chrono::duration<double>(Clock::now() - start_).count();
+    double ticks = g_ticks - start_ticks_;
+    double frames = g_frame_idx - start_frame_;
+    double accounted = 0;
+    printf("stats: total %.2fs host, %.4fs simulated, %.0f frames, %lu evals\n",
+           secs, ticks / TICKS_PER_SECOND, frames, evals_);
+    printf("stats: ticks/s=%.0f, frames/s=%.2f, rtf=%.4f\n", ticks / secs,
+           frames / secs, ticks / TICKS_PER_SECOND / secs);
+    for (unsigned c = 0; c < NumCategories; c++) {
+      double t = std::chrono::duration<double>(host_time_[c]).count();
+      accounted += t;
+      printf("stats: %-12s %10.3fs %6.2f%%\n", c_Names[c], t,
+             100.0 * t / secs);
+    }
+    printf("stats: %-12s %10.3fs %6.2f%%\n", "other", secs - accounted,
+           100.0 * (secs - accounted) / secs);
+
+    if (json_path_.empty())
+      return;
+    FILE *fp = fopen(json_path_.c_str(), "w");
+    if (!fp) {
+      std::cerr << "Unable to open '" << json_path_ << "'\n";
+      return;
+    }
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"host_seconds\": %f,\n", secs);
+    fprintf(fp, "  \"sim_seconds\": %f,\n", ticks / TICKS_PER_SECOND);
+    fprintf(fp, "  \"ticks\": %.0f,\n", ticks);
+    fprintf(fp, "  \"frames\": %.0f,\n", frames);
+    fprintf(fp, "  \"evals\": %lu,\n", evals_);
+    fprintf(fp, "  \"ticks_per_second\": %f,\n", ticks / secs);
+    fprintf(fp, "  \"frames_per_second\": %f,\n", frames / secs);
+    fprintf(fp, "  \"real_time_factor\": %f,\n",
+            ticks / TICKS_PER_SECOND / secs);
+    fprintf(fp, "  \"host_time\": {\n");
+    for (unsigned c = 0; c < NumCategories; c++) {
+      fprintf(fp, "    \"%s\": %f,\n", c_Names[c],
+              std::chrono::duration<double>(host_time_[c]).count());
     }
+    fprintf(fp, "    \"other\": %f\n", secs - accounted);
+    fprintf(fp, "  }\n");
+    fprintf(fp, "}\n");
+    fclose(fp);
   }
 
 private:
-  FILE *fp_;
-  uint32_t begin_frame_;
+  static constexpr const char *c_Names[NumCategories] = {
+      "eval",        "bridge",   "framedumper", "trace6502",
+      "profile6502", "traceiec", "tracertl",    "audio"};
+  uint32_t interval_frames_;
+  std::string json_path_;
+  Clock::time_point start_, interval_start_;
+  uint64_t start_ticks_, interval_start_ticks_;
+  uint32_t start_frame_, interval_start_frame_;
+  Clock::duration host_time_[NumCategories] = {};
+  uint64_t evals_ = 0;
 };
 
+constexpr const char *SimStats::c_Names[];
+
 class KeyInject {
 public:
   KeyInject(const std::string &keys) {
@@ -350,6 +2124,58 @@ private:
   decltype(key_cmds)::iterator key_cmds_iter;
 };
 
+// Read-only memory mapped view of a data slot file
+class DataSlot {
+public:
+  DataSlot(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+      std::cerr << "Unable to open '" << path << "'\n";
+      exit(1);
+    }
+    size_ = st.st_size;
+    if (size_ > 0) {
+      void *p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p == MAP_FAILED) {
+        std::cerr << "Unable to mmap '" << path << "'\n";
+        exit(1);
+      }
+      data_ = static_cast<const uint8_t *>(p);
+    }
+    close(fd);
+  }
+  DataSlot(DataSlot &&other) : data_(other.data_), size_(other.size_) {
+    other.data_ = nullptr;
+    other.size_ = 0;
+  }
+  DataSlot(const DataSlot &) = delete;
+  DataSlot &operator=(const DataSlot &) = delete;
+  ~DataSlot() {
+    if (data_)
+      munmap(const_cast<uint8_t *>(data_), size_);
+  }
+
+  uint32_t Size() const { return size_; }
+  // Big endian word at given offset, bytes past the end of file read as zero
+  uint32_t Word(uint32_t offset) const {
+    if (size_ >= 4 && offset <= size_ - 4) {
+      const uint8_t *p = data_ + offset;
+      return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    }
+    uint32_t word = 0;
+    for (unsigned i = 0; i < 4; i++) {
+      if (offset + i < size_)
+        word |= static_cast<uint32_t>(data_[offset + i]) << (8 * (3 - i));
+    }
+    return word;
+  }
+
+private:
+  const uint8_t *data_ = nullptr;
+  size_t size_ = 0;
+};
+
 class BridgeHandler {
 public:
   void Tick() {
@@ -368,7 +2194,7 @@ public:
       break;
     case 100: // Write Data Slot Size table (slot id)
       if (ds_it == dataslots.end()) {
-        bridge_state = 1;
+        bridge_state = slot_table_next_state;
       } else {
         auto &dse = *ds_it;
         dut->bridge_addr = 0xf8002000 + cntr * 8 + 0;
@@ -381,7 +2207,7 @@ public:
       auto &dse = *ds_it;
       dut->bridge_addr = 0xf8002000 + cntr * 8 + 4;
       dut->bridge_wr = 1;
-      dut->bridge_wr_data = dse.second.second;
+      dut->bridge_wr_data = dse.second.Size();
       cntr++;
       ds_it++;
       bridge_state = 100;
@@ -416,7 +2242,17 @@ public:
         bridge_state = 2;
       }
       break;
+    case 300: // Data slots inserted after boot, rewrite size table first
+      cntr = 0;
+      ds_it = dataslots.begin();
+      slot_table_next_state = 202;
+      bridge_state = 100;
+      break;
     case 2: // Wait for data-slot-read command
+      if (updated_dataslots_iter != updated_dataslots.end()) {
+        bridge_state = 300;
+        break;
+      }
       dut->bridge_addr = 0xf8001000;
       dut->bridge_rd = 1;
       if (dut->bridge_rd_data == 0x636D0180) {
@@ -445,22 +2281,22 @@ public:
     case 6: // Latch length
       ds_read_length = dut->bridge_rd_data;
       ds_read_cntr = 0;
+      ds_read_slot = FindDataSlot(ds_read_slot_id);
       bridge_state = 7;
       printf("data-slot-read: id=%d, offset=%d, bridge_addr=0x%x, length=%d\n",
              ds_read_slot_id, ds_read_slot_offset, ds_read_bridge_address,
              ds_read_length);
+      if (backdoor && BackdoorDataSlotRead()) {
+        ds_read_cntr = ds_read_length; // Done, report status next
+      }
       break;
     case 7: // Write data / status
       if (ds_read_cntr < ds_read_length) {
         dut->bridge_addr = ds_read_bridge_address + ds_read_cntr;
-        dut->bridge_wr_data = 0;
-        auto &fs = dataslots[ds_read_slot_id].first;
-        for (unsigned i = 0; i < 4; i++) {
-          uint8_t byte;
-          fs.seekg(ds_read_slot_offset + ds_read_cntr + i, std::ios::beg);
-          fs.read(reinterpret_cast<char *>(&byte), 1);
-          dut->bridge_wr_data |= static_cast<uint32_t>(byte) << (8 * (3 - i));
-        }
+        dut->bridge_wr_data =
+            ds_read_slot
+                ? ds_read_slot->Word(ds_read_slot_offset + ds_read_cntr)
+                : 0;
         dut->bridge_wr = 1;
         ds_read_cntr += 4;
       } else {
@@ -476,31 +2312,143 @@ public:
   }
 
   void RegisterDataSlot(uint16_t id, const std::string &path) {
-    std::ifstream instream(path, std::ios::in | std::ios::binary);
-    if (!instream) {
-      std::cerr << "Unable to open '" << path << "'\n";
-      exit(1);
-    }
-    instream.seekg(0, std::ios::end);
-    auto size = instream.tellg();
-    dataslots[id] = std::make_pair(std::move(instream), size);
+    dataslots.erase(id);
+    dataslots.emplace(id, DataSlot(path));
     if (id < 16) { // Only lower 16 are mapped to update register
       updated_dataslots.push_back(id);
     }
   }
-  void Finalize() { updated_dataslots_iter = updated_dataslots.begin(); }
+  // Insert a data slot while running, it is announced to the BIOS as updated
+  // (i.e. selected from the menu). Only valid while the bridge is idle.
+  void InsertDataSlot(uint16_t id, const std::string &path) {
+    auto pending = updated_dataslots_iter - updated_dataslots.begin();
+    RegisterDataSlot(id, path);
+    updated_dataslots_iter = updated_dataslots.begin() + pending;
+  }
+  bool Idle() const { return bridge_state == 2; }
+  // Serve data slot reads by writing the payload directly into the target
+  // memory of the model instead of one bridge write per clk_74a cycle.
+  void SetBackdoor(bool enable) { backdoor = enable; }
+
+  void Finalize() {
+    ds_it = dataslots.begin();
+    updated_dataslots_iter = updated_dataslots.begin();
+  }
+
+  // The data slot files themselves are not part of the state, the slots must
+  // be registered again before restoring. Slots registered now but not when
+  // the state was saved are announced to the BIOS as updated (i.e. inserted)
+  // once the bridge is idle.
+  void Save(VerilatedSerialize &os) {
+    uint32_t num_dataslots = dataslots.size();
+    SaveRaw(os, num_dataslots);
+    for (auto &dse : dataslots) {
+      SaveRaw(os, dse.first);
+      uint32_t size = dse.second.Size();
+      SaveRaw(os, size);
+    }
+    uint32_t num_pending = updated_dataslots.end() - updated_dataslots_iter;
+    SaveRaw(os, num_pending);
+    for (auto it = updated_dataslots_iter; it != updated_dataslots.end(); it++)
+      SaveRaw(os, *it);
+    SaveRaw(os, bridge_state);
+    SaveRaw(os, slot_table_next_state);
+    SaveRaw(os, ds_read_slot_id);
+    SaveRaw(os, ds_read_slot_offset);
+    SaveRaw(os, ds_read_bridge_address);
+    SaveRaw(os, ds_read_length);
+    SaveRaw(os, ds_read_cntr);
+    SaveRaw(os, cntr);
+  }
+  void Restore(VerilatedDeserialize &is) {
+    uint32_t num_dataslots;
+    RestoreRaw(is, num_dataslots);
+    std::map<uint16_t, uint32_t> saved_dataslots;
+    for (unsigned i = 0; i < num_dataslots; i++) {
+      uint16_t id;
+      uint32_t size;
+      RestoreRaw(is, id);
+      RestoreRaw(is, size);
+      saved_dataslots[id] = size;
+    }
+    for (auto &sdse : saved_dataslots) {
+      auto it = dataslots.find(sdse.first);
+      if (it == dataslots.end() || it->second.Size() != sdse.second) {
+        std::cerr << "Data slot " << sdse.first
+                  << " differs from the one in the saved state\n";
+        exit(1);
+      }
+    }
+    uint32_t num_pending;
+    RestoreRaw(is, num_pending);
+    std::vector<uint16_t> pending(num_pending);
+    for (auto &id : pending)
+      RestoreRaw(is, id);
+    for (auto id : updated_dataslots) {
+      if (!saved_dataslots.count(id))
+        pending.push_back(id);
+    }
+    updated_dataslots = pending;
+    updated_dataslots_iter = updated_dataslots.begin();
+    RestoreRaw(is, bridge_state);
+    RestoreRaw(is, slot_table_next_state);
+    RestoreRaw(is, ds_read_slot_id);
+    RestoreRaw(is, ds_read_slot_offset);
+    RestoreRaw(is, ds_read_bridge_address);
+    RestoreRaw(is, ds_read_length);
+    RestoreRaw(is, ds_read_cntr);
+    RestoreRaw(is, cntr);
+    ds_read_slot = FindDataSlot(ds_read_slot_id);
+    ds_it = std::next(dataslots.begin(),
+                      std::min<size_t>(cntr, dataslots.size()));
+  }
 
 private:
+  // Bridge writes to the DP RAMs below are byte swapped, see core_top.v
+  template <typename Mem>
+  void BackdoorFill(Mem &mem, unsigned depth, uint32_t offset) {
+    for (uint32_t cntr = 0; cntr < ds_read_length; cntr += 4) {
+      uint32_t word = ds_read_slot->Word(offset + cntr);
+      unsigned idx = ((ds_read_bridge_address + cntr) >> 2) & (depth - 1);
+      mem[idx] = __builtin_bswap32(word);
+    }
+  }
+  bool BackdoorDataSlotRead() {
+    auto *syms = dut->rootp->vlSymsp;
+    if (!ds_read_slot)
+      return false;
+    switch (ds_read_bridge_address >> 28) {
+    case 0x7: // Bridge DP RAM (ADDR = 8)
+      BackdoorFill(syms->TOP__core_top__u_bridge_dpram.mem, 1 << 8,
+                   ds_read_slot_offset);
+      return true;
+    case 0x9: // 1541 track DP RAM (ADDR = 11)
+      BackdoorFill(syms->TOP__core_top__u_bridge_1541_track_ram.mem, 1 << 11,
+                   ds_read_slot_offset);
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  DataSlot *FindDataSlot(uint32_t id) {
+    auto it = dataslots.find(id);
+    return it != dataslots.end() ? &it->second : nullptr;
+  }
+
+  bool backdoor = false;
   int bridge_state = 0;
+  int slot_table_next_state = 1;
   uint32_t ds_read_slot_id;
   uint32_t ds_read_slot_offset;
   uint32_t ds_read_bridge_address;
   uint32_t ds_read_length;
   uint32_t ds_read_cntr;
+  DataSlot *ds_read_slot = nullptr;
 
   unsigned cntr = 0;
 
-  std::map<uint16_t, std::pair<std::ifstream, uint32_t>> dataslots;
+  std::map<uint16_t, DataSlot> dataslots;
   decltype(dataslots)::iterator ds_it;
   std::vector<uint16_t> updated_dataslots;
   decltype(updated_dataslots)::iterator updated_dataslots_iter;
@@ -508,9 +2456,254 @@ private:
 
 double sc_time_stamp() { return 0; }
 
-int main(int argc, char *argv[]) {
+// Backdoor access to the memories of the model, bypassing the simulated buses
+// (--load-ram/--dump-ram). The spaces are
+//   c64    C64 main RAM (64 KB)
+//   c1541  C1541 RAM (2 KB)
+//   color  C64 color RAM (1 KB of which the low 4 bits are stored), made
+//          public and kept in its own scope by core/core_top-sim.vlt
+//   psram  Cartridge PSRAM as seen by the cartridge port, one byte per word
+//          (2 MB)
+class ModelMemory {
+public:
+  enum class Space { C64, C1541, Color, PSRAM };
+  struct Range {
+    Space space;
+    uint32_t start;
+    uint32_t end; // Exclusive
+  };
+
+  ModelMemory(PagedPSRAM *psram) : psram_(psram) {}
+
+  // SPACE[:START[-END]] with hexadecimal addresses and END inclusive
+  Range ParseRange(const std::string &spec) const {
+    Range r;
+    auto colon = spec.find(':');
+    std::string name = spec.substr(0, colon);
+    if (name == "c64")
+      r.space = Space::C64;
+    else if (name == "c1541")
+      r.space = Space::C1541;
+    else if (name == "color")
+      r.space = Space::Color;
+    else if (name == "psram" && psram_)
+      r.space = Space::PSRAM;
+    else
+      Bad(spec);
+    uint32_t size = Size(r.space);
+    r.start = 0;
+    r.end = size;
+    if (colon != std::string::npos) {
+      try {
+        size_t pos;
+        std::string range = spec.substr(colon + 1);
+        r.start = std::stoul(range, &pos, 16);
+        if (pos < range.size()) {
+          if (range[pos] != '-')
+            Bad(spec);
+          r.end = std::stoul(range.substr(pos + 1), nullptr, 16) + 1;
+        }
+      } catch (const std::logic_error &) {
+        Bad(spec);
+      }
+    }
+    if (r.start >= r.end || r.end > size)
+      Bad(spec);
+    return r;
+  }
+
+  static uint32_t Size(Space space) {
+    switch (space) {
+    case Space::C64:
+      return 1 << 16;
+    case Space::C1541:
+      return 1 << 11;
+    case Space::Color:
+      return 1 << 10;
+    case Space::PSRAM:
+      return 1 << 21;
+    }
+    return 0;
+  }
+
+  uint8_t Read(Space space, uint32_t addr) const {
+    auto *syms = dut->rootp->vlSymsp;
+    switch (space) {
+    case Space::C64:
+      return syms->TOP__core_top__u_c64_main_ram.mem[addr];
+    case Space::C1541:
+      return syms->TOP__core_top__u_c1541_ram.mem[addr];
+    case Space::Color:
+      return syms->TOP__core_top__u_myc64.u_ram_color[addr];
+    case Space::PSRAM:
+      return psram_->Peek(addr);
+    }
+    return 0;
+  }
+
+  void Write(Space space, uint32_t addr, uint8_t data) {
+    auto *syms = dut->rootp->vlSymsp;
+    switch (space) {
+    case Space::C64:
+      syms->TOP__core_top__u_c64_main_ram.mem[addr] = data;
+      break;
+    case Space::C1541:
+      syms->TOP__core_top__u_c1541_ram.mem[addr] = data;
+      break;
+    case Space::Color:
+      syms->TOP__core_top__u_myc64.u_ram_color[addr] = data & 0xf;
+      break;
+    case Space::PSRAM:
+      psram_->Poke(addr, (psram_->Peek(addr) & 0xff00) | data);
+      break;
+    }
+  }
+
+  // Write the contents of 'path' from the start of the range, as much of it as
+  // fits. Returns the number of bytes written.
+  uint32_t Load(const Range &r, const std::string &path) {
+    std::ifstream is(path, std::ios::binary);
+    if (!is) {
+      std::cerr << "Unable to open '" << path << "'\n";
+      exit(1);
+    }
+    std::vector<char> data((std::istreambuf_iterator<char>(is)),
+                           std::istreambuf_iterator<char>());
+    uint32_t n = std::min<size_t>(data.size(), r.end - r.start);
+    for (uint32_t i = 0; i < n; i++)
+      Write(r.space, r.start + i, data[i]);
+    return n;
+  }
+
+  void Dump(const Range &r, const std::string &path) const {
+    std::vector<uint8_t> data(r.end - r.start);
+    for (uint32_t i = 0; i < data.size(); i++)
+      data[i] = Read(r.space, r.start + i);
+    FILE *fp = fopen(path.c_str(), "wb");
+    if (!fp) {
+      std::cerr << "Unable to open '" << path << "'\n";
+      exit(1);
+    }
+    fwrite(data.data(), 1, data.size(), fp);
+    fclose(fp);
+  }
+
+private:
+  [[noreturn]] static void Bad(const std::string &spec) {
+    std::cerr << "Bad memory range '" << spec << "'\n";
+    exit(1);
+  }
+
+  PagedPSRAM *psram_;
+};
+
+//
+// Full simulation state (Verilated model + harness) checkpointing
+//
+
+#if SIM_SAVABLE
+static void SaveState(const std::string &path, bool clk_32mhz,
+                      PagedPSRAM *psram, BridgeHandler &bridge,
+                      Trace6502 *trace_cpu_c64, Trace6502 *trace_cpu_c1541,
+                      VideoCapture *video) {
+  VerilatedSave os;
+  os.open(path.c_str());
+  if (!os.isOpen()) {
+    std::cerr << "Unable to open '" << path << "'\n";
+    exit(1);
+  }
+  uint32_t magic = STATE_MAGIC;
+  SaveRaw(os, magic);
+  SaveRaw(os, g_ticks);
+  SaveRaw(os, g_frame_idx);
+  SaveRaw(os, clk_32mhz);
+  os << *dut;
+  bridge.Save(os);
+  // Optional parts are prefixed with their size so that a state can be
+  // restored with a different set of tracers enabled.
+  auto save_opt = [&](auto *part) {
+    uint32_t size = 0;
+    if (part)
+      part->VisitState([&](auto &v) { size += sizeof(v); });
+    SaveRaw(os, size);
+    if (part)
+      part->VisitState([&](auto &v) { SaveRaw(os, v); });
+  };
+  save_opt(psram);
+  save_opt(trace_cpu_c64);
+  save_opt(trace_cpu_c1541);
+  save_opt(video);
+  os.close();
+  printf("state-save: frame=%u, ticks=%lu, path=%s\n", g_frame_idx, g_ticks,
+         path.c_str());
+}
+
+// The 32 MHz domain must be clocked from reset on (see clk_32mhz_cntr in
+// core_top.v), so a state only restores with the same clk_32mhz setting
+static void RestoreState(const std::string &path, bool clk_32mhz,
+                         PagedPSRAM *psram, BridgeHandler &bridge,
+                         Trace6502 *trace_cpu_c64, Trace6502 *trace_cpu_c1541,
+                         VideoCapture *video) {
+  VerilatedRestore is;
+  is.open(path.c_str());
+  if (!is.isOpen()) {
+    std::cerr << "Unable to open '" << path << "'\n";
+    exit(1);
+  }
+  uint32_t magic;
+  RestoreRaw(is, magic);
+  if (magic != STATE_MAGIC) {
+    std::cerr << "'" << path << "' is not a saved simulator state\n";
+    exit(1);
+  }
+  RestoreRaw(is, g_ticks);
+  RestoreRaw(is, g_frame_idx);
+  bool saved_clk_32mhz;
+  RestoreRaw(is, saved_clk_32mhz);
+  if (saved_clk_32mhz != clk_32mhz) {
+    std::cerr << "'" << path << "' was saved "
+              << (saved_clk_32mhz ? "with" : "without")
+              << " a cartridge, --crt must be given "
+              << (saved_clk_32mhz ? "again" : "when saving the state")
+              << "\n";
+    exit(1);
+  }
+  is >> *dut;
+  bridge.Restore(is);
+  auto restore_opt = [&](auto *part) {
+    uint32_t size;
+    RestoreRaw(is, size);
+    if (part && size) {
+      part->VisitState([&](auto &v) { RestoreRaw(is, v); });
+    } else if (size) {
+      // Part not enabled in this run, skip over its data
+      std::vector<uint8_t> skip(size);
+      is.read(skip.data(), size);
+    }
+  };
+  restore_opt(psram);
+  restore_opt(trace_cpu_c64);
+  restore_opt(trace_cpu_c1541);
+  restore_opt(video);
+  is.close();
+  printf("state-restore: frame=%u, ticks=%lu, path=%s\n", g_frame_idx,
+         g_ticks, path.c_str());
+}
+#endif
+
+// Options of a simulation run. In batch mode they are taken from each
+// manifest line instead, the command line only giving the data slots to boot
+// with.
+struct RunOptions {
   uint32_t exit_frame = 0;
   bool dump_video = false;
+  unsigned dump_video_threads =
+      std::max(1u, std::thread::hardware_concurrency() / 2);
+  std::vector<uint32_t> dump_video_frames;
+  std::string video_out_path;
+  std::string video_format = "y4m";
+  std::string frame_hash_path;
+  std::vector<std::string> expect_hash;
 
   std::string prg_path;
   std::string g64_path;
@@ -519,47 +2712,328 @@ int main(int argc, char *argv[]) {
   std::string trace_path;
   std::vector<std::string> trace_modules;
   uint32_t trace_begin_frame = 0;
+  uint32_t trace_flight_frames = 0;
+  uint32_t trace_flight_post_frames = 1;
+  std::string trace_trigger;
+  bool trace_on_demand = false;
+  std::string trace_control_path;
 
   std::string cpu_c64_trace_path;
   std::string cpu_c1541_trace_path;
+  bool cpu_trace_binary = false;
+  std::string cpu_c64_trace_trigger;
+  std::string cpu_c1541_trace_trigger;
+
+  std::string profile_c64_path;
+  std::string profile_c1541_path;
 
   std::string iec_trace_path;
   uint32_t iec_trace_begin_frame = 0;
+  std::string iec_trace_format = "csv";
+  std::string iec_decode_path;
+
+  std::string audio_path;
+  std::string psram_stats_path;
 
   std::string keys_str;
 
-  CLI::App app{"Verilator based MyC64-pocket simulator"};
-  app.add_flag("--dump-video", dump_video, "Dump video output as .png");
-  app.add_option("--exit-frame", exit_frame, "Exit frame");
-  app.add_option("--trace", trace_path, ".fst trace output");
-  app.add_option("--trace-begin-frame", trace_begin_frame,
+  std::pair<uint32_t, std::string> save_state;
+
+  std::vector<std::tuple<uint32_t, std::string, std::string>> load_ram;
+  std::vector<std::tuple<uint32_t, std::string, std::string>> dump_ram;
+
+  bool stats_enabled = false;
+  uint32_t stats_interval = 100;
+  std::string stats_json_path;
+};
+
+// Add the RunOptions to 'app', returning the added options
+static std::vector<const CLI::Option *> AddRunOptions(CLI::App &app,
+                                                      RunOptions &o) {
+  size_t first = app.get_options().size();
+  app.add_flag("--dump-video", o.dump_video, "Dump video output as .png");
+  app.add_option("--dump-video-threads", o.dump_video_threads,
+                 "Number of .png encoder threads")
+      ->needs("--dump-video");
+  app.add_option("--dump-video-frames", o.dump_video_frames,
+                 "Only dump the given frames")
+      ->needs("--dump-video");
+  app.add_option("--video-out", o.video_out_path,
+                 "Stream video output to file ('-' for stdout)");
+  app.add_option("--video-format", o.video_format,
+                 "Format of --video-out stream (y4m or rgb24)")
+      ->check(CLI::IsMember({"y4m", "rgb24"}))
+      ->needs("--video-out");
+  app.add_option("--frame-hash", o.frame_hash_path,
+                 "Write a hash of each frame to file");
+  app.add_option("--expect-hash", o.expect_hash,
+                 "Exit with failure unless frame hashes as given (FRAME:HASH)")
+      ->take_all();
+  app.add_option("--exit-frame", o.exit_frame, "Exit frame");
+  app.add_option("--trace", o.trace_path, ".fst trace output");
+  app.add_option("--trace-begin-frame", o.trace_begin_frame,
                  "Start trace on given frame")
       ->needs("--trace");
-  app.add_option("--trace-modules", trace_modules, "Specify modules to trace")
+  app.add_option("--trace-modules", o.trace_modules, "Specify modules to trace")
+      ->needs("--trace");
+  app.add_option("--trace-flight", o.trace_flight_frames,
+                 "Flight recorder, keep only the last given number of frames "
+                 "of trace and write them when triggered")
       ->needs("--trace");
-  app.add_option("--prg", prg_path, ".prg file to put in slot")
+  app.add_option("--trace-flight-post", o.trace_flight_post_frames,
+                 "Frames to record after the flight recorder triggers")
+      ->needs("--trace-flight");
+  app.add_option("--trace-trigger", o.trace_trigger,
+                 "Flight recorder trigger, e.g. 'frame:8000,c1541pc:F56D,"
+                 "c64write:D020,iec_atn:0' (SIGUSR1 always triggers)")
+      ->needs("--trace-flight");
+  auto on_demand_opt =
+      app.add_flag("--trace-on-demand", o.trace_on_demand,
+                   "Start trace capture on SIGUSR1, stop on SIGUSR2")
+          ->needs("--trace")
+          ->excludes("--trace-flight");
+  app.add_option("--trace-control-file", o.trace_control_path,
+                 "Capture trace while the given file exists")
+      ->needs(on_demand_opt);
+  app.add_option("--prg", o.prg_path, ".prg file to put in slot")
       ->check(CLI::ExistingFile);
-  app.add_option("--g64", g64_path, ".g64 file to put in slot")
+  app.add_option("--g64", o.g64_path, ".g64 file to put in slot")
       ->check(CLI::ExistingFile);
-  app.add_option("--crt", crt_path, ".crt file to put in slot")
+  app.add_option("--crt", o.crt_path, ".crt file to put in slot")
       ->check(CLI::ExistingFile);
-  app.add_option("--iec-trace", iec_trace_path, "IEC trace output to .csv");
-  app.add_option("--iec-trace-begin-frame", iec_trace_begin_frame,
+  app.add_option("--iec-trace", o.iec_trace_path, "IEC trace output to .csv (or .vcd)");
+  app.add_option("--iec-trace-begin-frame", o.iec_trace_begin_frame,
                  "Start IEC trace on given frame");
-  app.add_option("--cpu-c64-trace", cpu_c64_trace_path,
+  app.add_option("--iec-trace-format", o.iec_trace_format,
+                 "IEC trace as every 1 MHz sample (csv) or only transitions "
+                 "(vcd)")
+      ->check(CLI::IsMember({"csv", "vcd"}))
+      ->needs("--iec-trace");
+  app.add_option("--iec-decode", o.iec_decode_path,
+                 "Log decoded IEC transactions to file and report load "
+                 "throughput at exit");
+  app.add_option("--dump-audio", o.audio_path,
+                 "SID output resampled to 48 kHz as .wav");
+  app.add_option("--psram-stats", o.psram_stats_path,
+                 "Cartridge PSRAM accesses, bytes and busy cycles per frame "
+                 "to .csv");
+  app.add_option("--cpu-c64-trace", o.cpu_c64_trace_path,
                  "Instruction trace of the C64 6510 CPU to file");
-  app.add_option("--cpu-c1541-trace", cpu_c1541_trace_path,
+  app.add_option("--cpu-c1541-trace", o.cpu_c1541_trace_path,
                  "Instruction trace of the C1541 6502 CPU to file");
+  app.add_option("--cpu-c64-trace-trigger", o.cpu_c64_trace_trigger,
+                 "When to record the C64 CPU trace, e.g. "
+                 "'frames=100-200,pc=E000-FFFF,start=exec:E5CD,"
+                 "stop=write:D020,history=1000'")
+      ->needs("--cpu-c64-trace");
+  app.add_option("--cpu-c1541-trace-trigger", o.cpu_c1541_trace_trigger,
+                 "When to record the C1541 CPU trace (as above)")
+      ->needs("--cpu-c1541-trace");
+  app.add_option("--profile-c64", o.profile_c64_path,
+                 "Cycle profile of the C64 6510 CPU to file (and "
+                 "file.callgrind)");
+  app.add_option("--profile-c1541", o.profile_c1541_path,
+                 "Cycle profile of the C1541 6502 CPU to file (and "
+                 "file.callgrind)");
+  app.add_flag("--cpu-trace-binary", o.cpu_trace_binary,
+               "Write CPU instruction traces in binary format (see "
+               "trace-dump)");
   app.add_option(
-      "--keys", keys_str,
+      "--keys", o.keys_str,
       "Key input string of the form "
       "'[150]10<SPACE>PRINT<LSHIFT>2HELLO<SPACE>WORLD<LSHIFT>2<RETURN>"
       "20<SPACE>GOTO<SPACE>10<RETURN>RUN<RETURN>'");
+  app.add_option("--save-state-at-frame", o.save_state,
+                 "Save simulation state to file on given frame");
+  app.add_option("--load-ram", o.load_ram,
+                 "Load file into memory on given frame, e.g. "
+                 "'0 c64:c000 data.bin' (spaces c64, c1541, color and psram)");
+  app.add_option("--dump-ram", o.dump_ram,
+                 "Dump memory to file on given frame, e.g. "
+                 "'300 c64:0400-07e7 screen.bin' (whole space if no range)");
+  app.add_flag("--stats", o.stats_enabled,
+               "Report simulation throughput and host time per handler");
+  app.add_option("--stats-interval", o.stats_interval,
+                 "Report throughput every given number of frames (0 = only "
+                 "at exit)")
+      ->needs("--stats");
+  app.add_option("--stats-json", o.stats_json_path,
+                 "Write run report as .json at exit")
+      ->needs("--stats");
+  auto all = app.get_options();
+  return {all.begin() + first, all.end()};
+}
+
+//
+// Batch mode - the simulation runs once up to the fork frame and is then
+// forked into a copy-on-write child process per manifest entry. Each child
+// continues with the RunOptions of its entry in a directory of its own.
+//
+
+class Batch {
+public:
+  struct Run {
+    std::string name;
+    std::string args;
+    RunOptions opts;
+  };
+
+  // One run per line: NAME OPTIONS..., empty lines and '#' comments ignored.
+  // Options are parsed up front so that a bad line fails the whole batch.
+  Batch(const std::string &manifest_path, unsigned jobs) : jobs_(jobs) {
+    std::ifstream ifs(manifest_path);
+    if (!ifs) {
+      std::cerr << "Could not open batch manifest '" << manifest_path << "'\n";
+      exit(1);
+    }
+    std::string line;
+    while (std::getline(ifs, line)) {
+      auto begin = line.find_first_not_of(" \t");
+      if (begin == std::string::npos || line[begin] == '#')
+        continue;
+      auto end = line.find_first_of(" \t", begin);
+      Run run;
+      run.name = line.substr(begin, end - begin);
+      if (end != std::string::npos)
+        run.args = line.substr(end);
+      CLI::App app{"Batch run " + run.name};
+      AddRunOptions(app, run.opts);
+      try {
+        app.parse(run.args, false);
+      } catch (const CLI::ParseError &e) {
+        std::cerr << "Batch run '" << run.name << "': ";
+        exit(app.exit(e));
+      }
+      runs_.push_back(run);
+    }
+  }
+
+  // Fork one child per run, at most jobs at a time. Returns the run to
+  // continue with in the child and, once all children have exited, nullptr in
+  // the parent.
+  const Run *Fork() {
+    auto start = std::chrono::steady_clock::now();
+    std::map<pid_t, const Run *> running;
+    for (auto &run : runs_) {
+      while (running.size() >= jobs_)
+        Wait(running);
+      // Do not let the child repeat output buffered before the fork
+      fflush(nullptr);
+      std::cout.flush();
+      pid_t pid = fork();
+      if (pid < 0) {
+        perror("fork");
+        failed_++;
+        continue;
+      }
+      if (pid == 0)
+        return &run;
+      running[pid] = &run;
+    }
+    while (!running.empty())
+      Wait(running);
+    double secs = std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+    printf("batch: runs=%zu, failed=%u, seconds=%.1f\n", runs_.size(),
+           failed_, secs);
+    return nullptr;
+  }
+  int Status() const { return failed_ ? 1 : 0; }
+  const std::vector<Run> &Runs() const { return runs_; }
+
+private:
+  void Wait(std::map<pid_t, const Run *> &running) {
+    int wstatus;
+    pid_t pid = wait(&wstatus);
+    if (pid < 0) {
+      perror("wait");
+      exit(1);
+    }
+    auto it = running.find(pid);
+    if (it == running.end())
+      return;
+    bool ok = WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0;
+    if (!ok)
+      failed_++;
+    printf("batch: %s %s\n", it->second->name.c_str(), ok ? "ok" : "FAILED");
+    running.erase(it);
+  }
+
+  unsigned jobs_;
+  unsigned failed_ = 0;
+  std::vector<Run> runs_;
+};
+
+int main(int argc, char *argv[]) {
+  std::string psram_timing;
+  std::string restore_state_path;
+
+  bool instant_load = false;
+
+  std::string batch_path;
+  uint32_t batch_fork_frame = 150;
+  unsigned batch_jobs = std::max(1u, std::thread::hardware_concurrency());
+
+  RunOptions opts;
+  CLI::App app{"Verilator based MyC64-pocket simulator"};
+  auto run_options = AddRunOptions(app, opts);
+  app.add_option("--psram-timing", psram_timing,
+                 "Cartridge PSRAM timing in ns, e.g. "
+                 "'access=70,write=70,pulse=45' (the psram.sv defaults)");
+  app.add_option("--restore-state", restore_state_path,
+                 "Restore simulation state from file")
+      ->check(CLI::ExistingFile);
+  app.add_flag("--instant-load", instant_load,
+               "Write data slot reads directly into the target memory "
+               "(not cycle accurate)");
+  app.add_option("--batch", batch_path,
+                 "Boot once and fork a run per line of manifest file "
+                 "(NAME OPTIONS...), outputs go to directory NAME")
+      ->check(CLI::ExistingFile);
+  app.add_option("--batch-fork-frame", batch_fork_frame,
+                 "Frame to fork the batch runs on")
+      ->needs("--batch");
+  app.add_option("--batch-jobs", batch_jobs,
+                 "Number of batch runs in parallel")
+      ->needs("--batch");
   CLI11_PARSE(app, argc, argv);
 
+#if !SIM_SAVABLE
+  if (!opts.save_state.second.empty() || !restore_state_path.empty()) {
+    std::cerr << "Simulator model built without --savable\n";
+    return 1;
+  }
+  // Only the forking thread survives in the child
+  if (!batch_path.empty()) {
+    std::cerr << "Batch mode needs the single-threaded model\n";
+    return 1;
+  }
+#endif
+  std::unique_ptr<Batch> batch;
+  // Tracing and the 32 MHz PSRAM domain (which must run from reset) are set
+  // up for all batch runs if any of them needs it
+  bool trace_ever = !opts.trace_path.empty();
+  bool clk_32mhz_enabled = CLK_32MHZ && !opts.crt_path.empty();
+  if (!batch_path.empty()) {
+    for (auto *opt : run_options) {
+      if (opt->count() && !opt->check_lname("prg") &&
+          !opt->check_lname("g64") && !opt->check_lname("crt")) {
+        std::cerr << opt->get_name()
+                  << " is given per run on the manifest lines in batch mode\n";
+        return 1;
+      }
+    }
+    batch = std::make_unique<Batch>(batch_path, std::max(1u, batch_jobs));
+    for (auto &run : batch->Runs()) {
+      trace_ever |= !run.opts.trace_path.empty();
+      clk_32mhz_enabled |= CLK_32MHZ && !run.opts.crt_path.empty();
+    }
+  }
+
   // Initialize Verilators variables
   Verilated::commandArgs(argc, argv);
-  Verilated::traceEverOn(!trace_path.empty());
+  Verilated::traceEverOn(trace_ever);
 
   dut = std::make_unique<Vcore_top>();
 
@@ -575,111 +3049,346 @@ int main(int argc, char *argv[]) {
   bridge.RegisterDataSlot(204, "1541-e000.bin");
 
   // Load .prg into slot
-  if (!prg_path.empty()) {
-    bridge.RegisterDataSlot(PRG_SLOT_ID, prg_path);
+  if (!opts.prg_path.empty()) {
+    bridge.RegisterDataSlot(PRG_SLOT_ID, opts.prg_path);
   }
   // Load .g64 into slot
-  if (!g64_path.empty()) {
-    bridge.RegisterDataSlot(G64_SLOT_ID, g64_path);
+  if (!opts.g64_path.empty()) {
+    bridge.RegisterDataSlot(G64_SLOT_ID, opts.g64_path);
   }
   // Load .crt into slot
-  if (!crt_path.empty()) {
-    bridge.RegisterDataSlot(CRT_SLOT_ID, crt_path);
+  if (!opts.crt_path.empty()) {
+    bridge.RegisterDataSlot(CRT_SLOT_ID, opts.crt_path);
   }
 
+  bridge.SetBackdoor(instant_load);
   bridge.Finalize();
 
 #if CLK_32MHZ
-  SimplePSRAM psram;
+  PagedPSRAM psram(PSRAMTiming::Parse(psram_timing));
+  PagedPSRAM *psram_p = &psram;
+#else
+  PagedPSRAM *psram_p = nullptr;
 #endif
+  ModelMemory model_mem(psram_p);
+
+  // Backdoor memory loads and dumps, done in between loop iterations at the
+  // start of their frame with loads before dumps
+  struct RamOp {
+    uint32_t frame;
+    bool load;
+    ModelMemory::Range range;
+    std::string path;
+  };
+  std::vector<RamOp> ram_ops;
+  auto do_ram_ops = [&] {
+    for (auto &op : ram_ops) {
+      if (op.frame != g_frame_idx)
+        continue;
+      uint32_t bytes = op.range.end - op.range.start;
+      if (op.load)
+        bytes = model_mem.Load(op.range, op.path);
+      else
+        model_mem.Dump(op.range, op.path);
+      printf("ram-%s: frame=%u, start=%x, bytes=%u, path=%s\n",
+             op.load ? "load" : "dump", g_frame_idx, op.range.start, bytes,
+             op.path.c_str());
+    }
+  };
 
+  // Outputs of the run, set up after the fork in batch mode
   std::unique_ptr<TraceRTL> trace_rtl;
-  if (!trace_path.empty()) {
-    trace_rtl = std::make_unique<TraceRTL>(trace_path, trace_modules,
-                                           trace_begin_frame);
-  }
   std::unique_ptr<Trace6502> trace_cpu_c64;
-  if (!cpu_c64_trace_path.empty()) {
-    trace_cpu_c64 = std::make_unique<Trace6502>(
-        cpu_c64_trace_path, dut->debug_c64_cpu_valid, dut->debug_c64_cpu_sync,
-        dut->debug_c64_cpu_addr, dut->debug_c64_cpu_data,
-        dut->debug_c64_cpu_regs);
-  }
   std::unique_ptr<Trace6502> trace_cpu_c1541;
-  if (!cpu_c1541_trace_path.empty()) {
-    trace_cpu_c1541 = std::make_unique<Trace6502>(
-        cpu_c1541_trace_path, dut->debug_c1541_cpu_valid,
-        dut->debug_c1541_cpu_sync, dut->debug_c1541_cpu_addr,
-        dut->debug_c1541_cpu_data, dut->debug_c1541_cpu_regs);
-  }
+  std::unique_ptr<Profile6502> profile_c64;
+  std::unique_ptr<Profile6502> profile_c1541;
   std::unique_ptr<KeyInject> key_inject;
-  if (!keys_str.empty()) {
-    key_inject = std::make_unique<KeyInject>(keys_str);
-  }
-
   std::unique_ptr<FrameDumper> framedumper;
-  if (dump_video) {
-    framedumper = std::make_unique<FrameDumper>();
-  }
-
+  std::unique_ptr<VideoStream> video_stream;
+  std::unique_ptr<FrameHash> frame_hash;
+  std::unique_ptr<VideoCapture> video;
   std::unique_ptr<TraceIEC> iec_trace;
-  if (!iec_trace_path.empty()) {
-    iec_trace =
-        std::make_unique<TraceIEC>(iec_trace_path, iec_trace_begin_frame);
+  std::unique_ptr<IECDecoder> iec_decoder;
+  std::unique_ptr<AudioCapture> audio;
+  std::unique_ptr<SimStats> stats;
+  auto setup_run = [&] {
+    ram_ops.clear();
+    for (auto &l : opts.load_ram)
+      ram_ops.push_back({std::get<0>(l), true,
+                         model_mem.ParseRange(std::get<1>(l)), std::get<2>(l)});
+    for (auto &d : opts.dump_ram)
+      ram_ops.push_back({std::get<0>(d), false,
+                         model_mem.ParseRange(std::get<1>(d)), std::get<2>(d)});
+    std::stable_sort(ram_ops.begin(), ram_ops.end(),
+                     [](auto &a, auto &b) { return a.load && !b.load; });
+    if (!opts.trace_path.empty()) {
+      trace_rtl = std::make_unique<TraceRTL>(
+          opts.trace_path, opts.trace_modules, opts.trace_begin_frame,
+          opts.trace_flight_frames, opts.trace_flight_post_frames,
+          opts.trace_trigger, opts.trace_on_demand, opts.trace_control_path);
+    }
+    if (!opts.cpu_c64_trace_path.empty()) {
+      trace_cpu_c64 = std::make_unique<Trace6502>(
+          opts.cpu_c64_trace_path, opts.cpu_trace_binary,
+          Trace6502Trigger::Parse(opts.cpu_c64_trace_trigger),
+          dut->debug_c64_cpu_valid, dut->debug_c64_cpu_sync,
+          dut->debug_c64_cpu_addr, dut->debug_c64_cpu_data,
+          dut->debug_c64_cpu_we, dut->debug_c64_cpu_regs);
+    }
+    if (!opts.cpu_c1541_trace_path.empty()) {
+      trace_cpu_c1541 = std::make_unique<Trace6502>(
+          opts.cpu_c1541_trace_path, opts.cpu_trace_binary,
+          Trace6502Trigger::Parse(opts.cpu_c1541_trace_trigger),
+          dut->debug_c1541_cpu_valid, dut->debug_c1541_cpu_sync,
+          dut->debug_c1541_cpu_addr, dut->debug_c1541_cpu_data,
+          dut->debug_c1541_cpu_we, dut->debug_c1541_cpu_regs);
+    }
+    if (!opts.profile_c64_path.empty()) {
+      profile_c64 = std::make_unique<Profile6502>(
+          opts.profile_c64_path, dut->debug_c64_cpu_valid,
+          dut->debug_c64_cpu_sync, dut->debug_c64_cpu_addr,
+          dut->debug_c64_cpu_data, dut->debug_c64_cpu_we,
+          dut->debug_c64_cpu_regs);
+    }
+    if (!opts.profile_c1541_path.empty()) {
+      profile_c1541 = std::make_unique<Profile6502>(
+          opts.profile_c1541_path, dut->debug_c1541_cpu_valid,
+          dut->debug_c1541_cpu_sync, dut->debug_c1541_cpu_addr,
+          dut->debug_c1541_cpu_data, dut->debug_c1541_cpu_we,
+          dut->debug_c1541_cpu_regs);
+    }
+    if (!opts.keys_str.empty()) {
+      key_inject = std::make_unique<KeyInject>(opts.keys_str);
+    }
+    if (opts.dump_video) {
+      framedumper = std::make_unique<FrameDumper>(opts.dump_video_threads,
+                                                  opts.dump_video_frames);
+    }
+    if (!opts.video_out_path.empty()) {
+      video_stream = std::make_unique<VideoStream>(
+          opts.video_out_path, opts.video_format == "rgb24"
+                                   ? VideoStream::Format::RGB24
+                                   : VideoStream::Format::Y4M);
+    }
+    if (!opts.frame_hash_path.empty() || !opts.expect_hash.empty()) {
+      frame_hash =
+          std::make_unique<FrameHash>(opts.frame_hash_path, opts.expect_hash);
+    }
+    if (framedumper || video_stream || frame_hash) {
+      video = std::make_unique<VideoCapture>();
+      if (framedumper)
+        video->AddSink([&](const std::vector<uint8_t> &rgb) {
+          framedumper->Frame(rgb);
+        });
+      if (video_stream)
+        video->AddSink([&](const std::vector<uint8_t> &rgb) {
+          video_stream->Frame(rgb);
+        });
+      if (frame_hash)
+        video->AddSink([&](const std::vector<uint8_t> &rgb) {
+          frame_hash->Frame(rgb);
+        });
+    }
+    if (!opts.iec_trace_path.empty()) {
+      iec_trace = std::make_unique<TraceIEC>(
+          opts.iec_trace_path, opts.iec_trace_begin_frame,
+          opts.iec_trace_format == "vcd" ? TraceIEC::Format::VCD
+                                         : TraceIEC::Format::CSV);
+    }
+    if (!opts.iec_decode_path.empty()) {
+      iec_decoder = std::make_unique<IECDecoder>(opts.iec_decode_path);
+    }
+    if (!opts.audio_path.empty()) {
+      audio = std::make_unique<AudioCapture>(opts.audio_path);
+    }
+#if CLK_32MHZ
+    if (!opts.psram_stats_path.empty()) {
+      psram.OpenStats(opts.psram_stats_path);
+    }
+#endif
+    if (opts.stats_enabled) {
+      stats = std::make_unique<SimStats>(opts.stats_interval,
+                                         opts.stats_json_path);
+    }
+  };
+  if (!batch)
+    setup_run();
+
+  // clk_74a is the 8 MHz system clock in simulation. The 32 MHz PSRAM domain
+  // only does any work for cartridges so it is left idle otherwise.
+  SimClock clk_74a{dut->clk_74a, 4, true};
+  SimClock clk_32mhz{dut->clk_32mhz, 1, clk_32mhz_enabled};
+
+  if (!restore_state_path.empty()) {
+#if SIM_SAVABLE
+    RestoreState(restore_state_path, clk_32mhz.enabled, psram_p, bridge,
+                 trace_cpu_c64.get(), trace_cpu_c1541.get(), video.get());
+#endif
+  } else {
+    dut->reset_n = 0;
+    dut->eval();
   }
+  do_ram_ops();
 
-  dut->reset_n = 0;
-  dut->eval();
+  // Run handler, accounting its host time when --stats is given
+  auto timed = [&](SimStats::Category c, auto &&f) {
+    if (stats)
+      stats->Measure(c, f);
+    else
+      f();
+  };
 
-  unsigned reset_cntr = 0;
-  while (!Verilated::gotFinish()) {
-    if (reset_cntr++ > 320) {
+  int status = 0;
+  bool save_state_pending = false;
+  bool ram_ops_pending = false;
+  bool done = false;
+  while (!Verilated::gotFinish() && !done) {
+    g_ticks = clk_74a.NextEdge();
+    if (clk_32mhz.enabled)
+      g_ticks = std::min(g_ticks, clk_32mhz.NextEdge());
+    if (g_ticks > 320) {
       dut->reset_n = 1;
     }
 #if CLK_32MHZ
-    dut->clk_32mhz = !dut->clk_32mhz;
-    if (dut->clk_32mhz) {
+    if (clk_32mhz.Edge()) {
       psram.Tick();
     }
-    if (g_ticks % 4 == 0) {
 #endif
-      dut->clk_74a = !dut->clk_74a;
-      if (dut->clk_74a) {
-        // Handle mockup bridge
-        bridge.Tick();
-        // Key injection
-        if (key_inject)
-          key_inject->Tick();
-        // Frame dumper
-        if (framedumper)
-          framedumper->Tick();
-        // Trace C64 CPU
-        if (trace_cpu_c64)
-          trace_cpu_c64->Tick();
-        // Trace C1541 CPU
-        if (trace_cpu_c1541)
-          trace_cpu_c1541->Tick();
-        // Trace IEC bus
-        if (iec_trace)
-          iec_trace->Tick();
-        // Frame index increment if vsync comes after all handlers
-        if (dut->video_vs) {
-          g_frame_idx++;
-          if (exit_frame != 0 && exit_frame == g_frame_idx) {
-            exit(0);
-          }
+    if (clk_74a.Edge()) {
+      // Handle mockup bridge
+      timed(SimStats::Bridge, [&] { bridge.Tick(); });
+      // Key injection
+      if (key_inject)
+        key_inject->Tick();
+      // Frame dumper
+      if (video)
+        timed(SimStats::FrameDumper, [&] { video->Tick(); });
+      // Trace C64 CPU
+      if (trace_cpu_c64)
+        timed(SimStats::Trace6502, [&] { trace_cpu_c64->Tick(); });
+      // Trace C1541 CPU
+      if (trace_cpu_c1541)
+        timed(SimStats::Trace6502, [&] { trace_cpu_c1541->Tick(); });
+      // Profile CPUs
+      if (profile_c64)
+        timed(SimStats::Profile6502, [&] { profile_c64->Tick(); });
+      if (profile_c1541)
+        timed(SimStats::Profile6502, [&] { profile_c1541->Tick(); });
+      // Trace IEC bus
+      if (iec_trace)
+        timed(SimStats::TraceIEC, [&] { iec_trace->Tick(); });
+      if (iec_decoder)
+        timed(SimStats::TraceIEC, [&] { iec_decoder->Tick(); });
+      // SID audio
+      if (audio)
+        timed(SimStats::Audio, [&] { audio->Tick(); });
+      // Frame index increment if vsync comes after all handlers
+      if (dut->video_vs) {
+        g_frame_idx++;
+        if (stats)
+          stats->Frame();
+#if CLK_32MHZ
+        if (clk_32mhz.enabled)
+          psram.Frame();
+#endif
+        if (!opts.save_state.second.empty() &&
+            opts.save_state.first == g_frame_idx) {
+          save_state_pending = true;
+        }
+        ram_ops_pending = !ram_ops.empty();
+        if (opts.exit_frame != 0 && opts.exit_frame == g_frame_idx) {
+          done = true;
         }
       }
-#if CLK_32MHZ
     }
-#endif
-    dut->eval();
-    dut->eval();
+    // One evaluation per tick with at least one clock edge
+    timed(SimStats::Eval, [&] { dut->eval(); });
     if (trace_rtl) {
-      trace_rtl->Tick();
+      timed(SimStats::TraceRTL, [&] { trace_rtl->Tick(); });
     }
     g_ticks++;
+    if (ram_ops_pending) {
+      do_ram_ops();
+      ram_ops_pending = false;
+    }
+    // State is saved in between loop iterations so that a restored run
+    // resumes at the top of the loop
+    if (save_state_pending) {
+#if SIM_SAVABLE
+      SaveState(opts.save_state.second, clk_32mhz.enabled, psram_p, bridge,
+                trace_cpu_c64.get(), trace_cpu_c1541.get(), video.get());
+#endif
+      save_state_pending = false;
+    }
+    // Batch runs are forked in between loop iterations too, once booted and
+    // with the bridge idle so that their slots can be inserted
+    if (batch && g_frame_idx >= batch_fork_frame && bridge.Idle()) {
+      const Batch::Run *run = batch->Fork();
+      if (!run) {
+        status = batch->Status();
+        break;
+      }
+      Batch::Run this_run = *run;
+      batch.reset();
+      // Output of the run goes to NAME/sim.log. Its options were parsed (and
+      // slot paths checked) before changing directory, so slot paths are
+      // relative to the manifest user's working directory.
+      mkdir(this_run.name.c_str(), 0777);
+      std::string log_path = this_run.name + "/sim.log";
+      int log_fd = open(log_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      if (log_fd < 0) {
+        perror(log_path.c_str());
+        return 1;
+      }
+      dup2(log_fd, STDOUT_FILENO);
+      dup2(log_fd, STDERR_FILENO);
+      close(log_fd);
+      opts = this_run.opts;
+      if (opts.exit_frame <= g_frame_idx) {
+        std::cerr << "Batch run needs an --exit-frame after frame "
+                  << g_frame_idx << "\n";
+        return 1;
+      }
+      if (!opts.prg_path.empty())
+        bridge.InsertDataSlot(PRG_SLOT_ID, opts.prg_path);
+      if (!opts.g64_path.empty())
+        bridge.InsertDataSlot(G64_SLOT_ID, opts.g64_path);
+      if (!opts.crt_path.empty())
+        bridge.InsertDataSlot(CRT_SLOT_ID, opts.crt_path);
+      if (chdir(this_run.name.c_str())) {
+        perror(this_run.name.c_str());
+        return 1;
+      }
+      printf("batch: run=%s, frame=%u, args=%s\n", this_run.name.c_str(),
+             g_frame_idx, this_run.args.c_str());
+      setup_run();
+      do_ram_ops();
+    }
   }
 
-  return 0;
+  if (stats)
+    stats->Report();
+  if (profile_c64)
+    profile_c64->Report();
+  if (profile_c1541)
+    profile_c1541->Report();
+  if (iec_decoder)
+    iec_decoder->Report();
+  if (audio)
+    audio->Report();
+#if CLK_32MHZ
+  if (!opts.psram_stats_path.empty())
+    psram.Report();
+#endif
+
+  if (frame_hash && !frame_hash->Check())
+    status = 1;
+
+  // Tear down the model, and with it the worker threads of a multi-threaded
+  // build, before static destruction
+  trace_rtl.reset();
+  dut->final();
+  dut.reset();
+
+  return status;
 }
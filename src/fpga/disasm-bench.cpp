@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2024 Markus Lavin (https://www.zzzconsulting.se/)
+ *
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+// Compares the buffer based disassembler against the original fprintf based
+// one (kept below as legacy::disasm) and checks that both produce the same
+// text for all documented opcodes.
+//
+// make disasm-bench
+
+#include "disasm.h"
+#include <chrono>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+namespace legacy {
+/* d6502 v0.4 - borrowed from http://forum.6502.org/viewtopic.php?t=3644 */
+
+// clang-format off
+// Padding for 1,2 & 3 byte instructions
+const char *padding[3] = {"        ","    ",""};
+
+// 57 Instructions + Undefined ("???")
+const char *mnemonics[58] = {
+//   0     1     2     3     4     5     6     7     8     9
+   "ADC","AND","ASL","BCC","BCS","BEQ","BIT","BMI","BNE","BPL", // 0
+   "BRK","BVC","BVS","CLC","CLD","CLI","CLV","CMP","CPX","CPY", // 1
+   "DEC","DEX","DEY","EOR","INC","INX","INY","JMP","JSR","LDA", // 2
+   "LDX","LDY","LSR","NOP","ORA","PHA","PHP","PLA","PLP","ROL", // 3
+   "ROR","ROT","RTI","RTS","SBC","SEC","SED","SEI","STA","STX", // 4
+   "STY","TAX","TAY","TSX","TXA","TXS","TYA","???"};            // 5
+
+// This is a lookup of the text formating required for mode output, plus one entry to distinguish relative mode
+   const char *modes[9][2]={{"",""},{"#",""},{"",",X"},{"",",Y"},{"(",",X)"},{"(","),Y"},{"(",")"},{"A",""},{"",""}};
+
+// Opcode Properties for 256 opcodes {length_in_bytes, mnemonic_lookup, mode_chars_lookup}
+int opcode_props[256][3] = {
+//      0        1        2        3        4        5        6        7        8        9        A        B        C        D        E        F
+//  ******** -------- ******** -------- ******** -------- ******** -------- ******** -------- ******** -------- ******** -------- ******** --------
+    {1,10,0},{2,34,4},{1,57,0},{1,57,0},{1,57,0},{2,34,0},{2,2,0}, {1,57,0},{1,36,0},{2,34,1},{1,2,7}, {1,57,0},{1,57,0},{3,34,0},{3,2,0}, {1,57,0}, // 0
+    {2,9,8}, {2,34,5},{1,57,0},{1,57,0},{1,57,0},{2,34,2},{2,2,2}, {1,57,0},{1,13,0},{3,34,3},{1,57,0},{1,57,0},{1,57,0},{3,34,2},{3,2,2}, {1,57,0}, // 1
+    {3,28,0},{2,1,4}, {1,57,0},{1,57,0},{2,6,0}, {2,1,0}, {2,39,0},{1,57,0},{1,38,0},{2,1,1}, {1,39,7},{1,57,0},{3,6,0}, {3,1,0}, {3,39,0},{1,57,0}, // 2
+    {2,7,8}, {2,1,5}, {1,57,0},{1,57,0},{1,57,0},{2,1,2}, {2,39,2},{1,57,0},{1,45,0},{3,1,3}, {1,57,0},{1,57,0},{1,57,0},{3,1,2}, {3,39,2},{1,57,0}, // 3
+    {1,42,0},{2,23,4},{1,57,0},{1,57,0},{1,57,0},{2,23,0},{2,32,0},{1,57,0},{1,35,0},{2,23,1},{1,32,7},{1,57,0},{3,27,0},{3,23,0},{3,32,0},{1,57,0}, // 4
+    {2,11,8},{2,23,5},{1,57,0},{1,57,0},{1,57,0},{2,23,2},{2,32,2},{1,57,0},{1,15,0},{3,23,3},{1,57,0},{1,57,0},{1,57,0},{3,23,2},{3,32,2},{1,57,0}, // 5
+    {1,43,0},{2,0,4}, {1,57,0},{1,57,0},{1,57,0},{2,0,0}, {2,40,0},{1,57,0},{1,37,0},{2,0,1}, {1,40,7},{1,57,0},{3,27,6},{3,0,0}, {3,40,0},{1,57,0}, // 6
+    {2,12,8},{2,0,5}, {1,57,0},{1,57,0},{1,57,0},{2,0,2}, {2,40,2},{1,57,0},{1,47,0},{3,0,3}, {1,57,0},{1,57,0},{1,57,0},{3,0,2}, {3,40,2},{1,57,0}, // 7
+    {1,57,0},{2,48,4},{1,57,0},{1,57,0},{2,50,0},{2,48,0},{2,49,0},{1,57,0},{1,22,0},{1,57,0},{1,54,0},{1,57,0},{3,50,0},{3,48,0},{3,49,0},{1,57,0}, // 8
+    {2,3,8}, {2,48,5},{1,57,0},{1,57,0},{2,50,2},{2,48,2},{2,49,3},{1,57,0},{1,56,0},{3,48,3},{1,55,0},{1,57,0},{1,57,0},{3,48,2},{1,57,0},{1,57,0}, // 9
+    {2,31,1},{2,29,4},{2,30,1},{1,57,0},{2,31,0},{2,29,0},{2,30,0},{1,57,0},{1,52,0},{2,29,1},{1,51,0},{1,57,0},{3,31,0},{3,29,0},{3,30,0},{1,57,0}, // A
+    {2,4,8}, {2,29,5},{1,57,0},{1,57,0},{2,31,2},{2,29,2},{2,30,3},{1,57,0},{1,16,0},{3,29,3},{1,53,0},{1,57,0},{3,31,2},{3,29,2},{3,30,3},{1,57,0}, // B
+    {2,19,1},{2,17,4},{1,57,0},{1,57,0},{2,19,0},{2,17,0},{2,20,0},{1,57,0},{1,26,0},{2,17,1},{1,21,0},{1,57,0},{3,19,0},{3,17,0},{3,20,0},{1,57,0}, // C
+    {2,8,8}, {2,17,5},{1,57,0},{1,57,0},{1,57,0},{2,17,2},{2,20,2},{1,57,0},{1,14,0},{3,17,3},{1,57,0},{1,57,0},{1,57,0},{3,17,2},{3,20,2},{1,57,0}, // D
+    {2,18,1},{2,44,4},{1,57,0},{1,57,0},{2,18,0},{2,44,0},{2,24,0},{1,57,0},{1,25,0},{2,44,1},{1,33,0},{1,57,0},{3,18,0},{3,44,0},{3,24,0},{1,57,0}, // E
+    {2,5,8}, {2,44,5},{1,57,0},{1,57,0},{1,57,0},{2,44,2},{2,24,2},{1,57,0},{1,46,0},{3,44,3},{1,57,0},{1,57,0},{1,57,0},{3,44,2},{3,24,2},{1,57,0}  // F
+};
+// clang-format on
+
+unsigned disasm(FILE *fp, const Memory &mem, uint16_t addr) {
+  auto props = opcode_props[mem[addr]];
+  auto paramcount = props[0];
+  auto &mnemonic = mnemonics[props[1]];
+  auto addrmode = props[2];
+  auto pre = modes[addrmode][0];
+  auto post = modes[addrmode][1];
+  auto pad = padding[(paramcount - 1)];
+  unsigned print_len = 0;
+
+  print_len += fprintf(fp, "$%04X   ", addr);
+  for (unsigned i = 0; i < unsigned(paramcount); i++)
+    print_len += fprintf(fp, "$%02X ", mem[addr + i]);
+
+  print_len += fprintf(fp, " %s %s %s", pad, mnemonic, pre);
+
+  if (paramcount == 2) { // Single operand instruction
+    auto byte = mem[addr + 1];
+    if (addrmode == 8) { // Addressing mode is relative
+      print_len +=
+          fprintf(fp, "$%04X", (addr + 2 + ((byte < 128) ? byte : byte - 256)));
+    } else {
+      print_len += fprintf(fp, "$%02X", byte);
+    }
+  }
+  if (paramcount == 3) // Two operand instruction
+    print_len += fprintf(fp, "$%02X%02X", mem[addr + 2], mem[addr + 1]);
+  print_len += fprintf(fp, "%s", post);
+
+  return print_len;
+}
+} // namespace legacy
+
+int main(int argc, char *argv[]) {
+  unsigned num_insns = argc > 1 ? atoi(argv[1]) : 1000000;
+
+  // Random instructions placed back to back
+  Memory mem;
+  srand(1);
+  for (auto &b : mem)
+    b = rand();
+  std::vector<uint16_t> addrs(num_insns);
+  uint16_t addr = 0;
+  for (auto &a : addrs) {
+    a = addr;
+    addr = (addr + 3) % 0xfffd; // legacy reads past the end of mem
+  }
+
+  // Same output for everything the legacy table knows about
+  unsigned mismatches = 0;
+  for (unsigned op = 0; op < 256; op++) {
+    if (legacy::opcode_props[op][1] == 57) // ???
+      continue;
+    uint8_t bytes[3] = {uint8_t(op), 0x34, 0x12};
+    Memory m = {};
+    memcpy(&m[0x1000], bytes, sizeof(bytes));
+    char legacy_buf[256];
+    FILE *fp = fmemopen(legacy_buf, sizeof(legacy_buf), "w");
+    legacy::disasm(fp, m, 0x1000);
+    fclose(fp);
+    char buf[DISASM_MAX_LEN];
+    disasm(buf, sizeof(buf), 0x1000, bytes);
+    if (strcmp(buf, legacy_buf)) {
+      printf("mismatch $%02X: '%s' vs '%s'\n", op, buf, legacy_buf);
+      mismatches++;
+    }
+  }
+
+  FILE *null = fopen("/dev/null", "w");
+  using Clock = std::chrono::steady_clock;
+  auto time = [&](const char *name, auto &&f) {
+    auto t0 = Clock::now();
+    for (auto a : addrs)
+      f(a);
+    double ns = std::chrono::duration<double, std::nano>(Clock::now() - t0)
+                    .count();
+    printf("%-24s %8.1f ns/insn\n", name, ns / num_insns);
+  };
+  time("legacy (FILE)", [&](uint16_t a) { legacy::disasm(null, mem, a); });
+  time("buffer (FILE wrapper)", [&](uint16_t a) { disasm(null, mem, a); });
+  char buf[DISASM_MAX_LEN];
+  uint64_t sum = 0;
+  time("buffer", [&](uint16_t a) {
+    uint8_t bytes[3] = {mem[a], mem[uint16_t(a + 1)], mem[uint16_t(a + 2)]};
+    sum += disasm(buf, sizeof(buf), a, bytes);
+  });
+  fclose(null);
+  printf("%u mismatches (%lu)\n", mismatches, sum);
+  return mismatches != 0;
+}
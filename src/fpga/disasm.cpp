@@ -1,80 +1,130 @@
 /* d6502 v0.4 - borrowed from http://forum.6502.org/viewtopic.php?t=3644 */
 
-#include <array>
-#include <stdio.h>
-#include <stdlib.h>
+#include "disasm.h"
+#include <algorithm>
 #include <string.h>
 
+namespace {
 // clang-format off
 // Padding for 1,2 & 3 byte instructions
-const char *padding[3] = {"        ","    ",""};
+constexpr const char *padding[3] = {"        ","    ",""};
 
-// 57 Instructions + Undefined ("???")
-const char *mnemonics[58] = {
+// 57 Instructions + Undefined ("???") + 20 undocumented NMOS instructions
+constexpr const char *mnemonics[78] = {
 //   0     1     2     3     4     5     6     7     8     9
    "ADC","AND","ASL","BCC","BCS","BEQ","BIT","BMI","BNE","BPL", // 0
    "BRK","BVC","BVS","CLC","CLD","CLI","CLV","CMP","CPX","CPY", // 1
    "DEC","DEX","DEY","EOR","INC","INX","INY","JMP","JSR","LDA", // 2
    "LDX","LDY","LSR","NOP","ORA","PHA","PHP","PLA","PLP","ROL", // 3
    "ROR","ROT","RTI","RTS","SBC","SEC","SED","SEI","STA","STX", // 4
-   "STY","TAX","TAY","TSX","TXA","TXS","TYA","???"};            // 5
+   "STY","TAX","TAY","TSX","TXA","TXS","TYA","???","ALR","ANC", // 5
+   "ANE","ARR","DCP","ISC","JAM","LAS","LAX","LXA","RLA","RRA", // 6
+   "SAX","SBX","SHA","SHX","SHY","SLO","SRE","TAS"};            // 7
 
 // This is a lookup of the text formating required for mode output, plus one entry to distinguish relative mode
-   const char *modes[9][2]={{"",""},{"#",""},{"",",X"},{"",",Y"},{"(",",X)"},{"(","),Y"},{"(",")"},{"A",""},{"",""}};
+constexpr const char *modes[9][2]={{"",""},{"#",""},{"",",X"},{"",",Y"},{"(",",X)"},{"(","),Y"},{"(",")"},{"A",""},{"",""}};
+
+struct OpcodeProps {
+  uint8_t length;   // In bytes
+  uint8_t mnemonic; // Index into mnemonics
+  uint8_t mode;     // Index into modes
+};
 
 // Opcode Properties for 256 opcodes {length_in_bytes, mnemonic_lookup, mode_chars_lookup}
-int opcode_props[256][3] = {
+constexpr OpcodeProps opcode_props[256] = {
 //      0        1        2        3        4        5        6        7        8        9        A        B        C        D        E        F
 //  ******** -------- ******** -------- ******** -------- ******** -------- ******** -------- ******** -------- ******** -------- ******** --------
-    {1,10,0},{2,34,4},{1,57,0},{1,57,0},{1,57,0},{2,34,0},{2,2,0}, {1,57,0},{1,36,0},{2,34,1},{1,2,7}, {1,57,0},{1,57,0},{3,34,0},{3,2,0}, {1,57,0}, // 0
-    {2,9,8}, {2,34,5},{1,57,0},{1,57,0},{1,57,0},{2,34,2},{2,2,2}, {1,57,0},{1,13,0},{3,34,3},{1,57,0},{1,57,0},{1,57,0},{3,34,2},{3,2,2}, {1,57,0}, // 1
-    {3,28,0},{2,1,4}, {1,57,0},{1,57,0},{2,6,0}, {2,1,0}, {2,39,0},{1,57,0},{1,38,0},{2,1,1}, {1,39,7},{1,57,0},{3,6,0}, {3,1,0}, {3,39,0},{1,57,0}, // 2
-    {2,7,8}, {2,1,5}, {1,57,0},{1,57,0},{1,57,0},{2,1,2}, {2,39,2},{1,57,0},{1,45,0},{3,1,3}, {1,57,0},{1,57,0},{1,57,0},{3,1,2}, {3,39,2},{1,57,0}, // 3
-    {1,42,0},{2,23,4},{1,57,0},{1,57,0},{1,57,0},{2,23,0},{2,32,0},{1,57,0},{1,35,0},{2,23,1},{1,32,7},{1,57,0},{3,27,0},{3,23,0},{3,32,0},{1,57,0}, // 4
-    {2,11,8},{2,23,5},{1,57,0},{1,57,0},{1,57,0},{2,23,2},{2,32,2},{1,57,0},{1,15,0},{3,23,3},{1,57,0},{1,57,0},{1,57,0},{3,23,2},{3,32,2},{1,57,0}, // 5
-    {1,43,0},{2,0,4}, {1,57,0},{1,57,0},{1,57,0},{2,0,0}, {2,40,0},{1,57,0},{1,37,0},{2,0,1}, {1,40,7},{1,57,0},{3,27,6},{3,0,0}, {3,40,0},{1,57,0}, // 6
-    {2,12,8},{2,0,5}, {1,57,0},{1,57,0},{1,57,0},{2,0,2}, {2,40,2},{1,57,0},{1,47,0},{3,0,3}, {1,57,0},{1,57,0},{1,57,0},{3,0,2}, {3,40,2},{1,57,0}, // 7
-    {1,57,0},{2,48,4},{1,57,0},{1,57,0},{2,50,0},{2,48,0},{2,49,0},{1,57,0},{1,22,0},{1,57,0},{1,54,0},{1,57,0},{3,50,0},{3,48,0},{3,49,0},{1,57,0}, // 8
-    {2,3,8}, {2,48,5},{1,57,0},{1,57,0},{2,50,2},{2,48,2},{2,49,3},{1,57,0},{1,56,0},{3,48,3},{1,55,0},{1,57,0},{1,57,0},{3,48,2},{1,57,0},{1,57,0}, // 9
-    {2,31,1},{2,29,4},{2,30,1},{1,57,0},{2,31,0},{2,29,0},{2,30,0},{1,57,0},{1,52,0},{2,29,1},{1,51,0},{1,57,0},{3,31,0},{3,29,0},{3,30,0},{1,57,0}, // A
-    {2,4,8}, {2,29,5},{1,57,0},{1,57,0},{2,31,2},{2,29,2},{2,30,3},{1,57,0},{1,16,0},{3,29,3},{1,53,0},{1,57,0},{3,31,2},{3,29,2},{3,30,3},{1,57,0}, // B
-    {2,19,1},{2,17,4},{1,57,0},{1,57,0},{2,19,0},{2,17,0},{2,20,0},{1,57,0},{1,26,0},{2,17,1},{1,21,0},{1,57,0},{3,19,0},{3,17,0},{3,20,0},{1,57,0}, // C
-    {2,8,8}, {2,17,5},{1,57,0},{1,57,0},{1,57,0},{2,17,2},{2,20,2},{1,57,0},{1,14,0},{3,17,3},{1,57,0},{1,57,0},{1,57,0},{3,17,2},{3,20,2},{1,57,0}, // D
-    {2,18,1},{2,44,4},{1,57,0},{1,57,0},{2,18,0},{2,44,0},{2,24,0},{1,57,0},{1,25,0},{2,44,1},{1,33,0},{1,57,0},{3,18,0},{3,44,0},{3,24,0},{1,57,0}, // E
-    {2,5,8}, {2,44,5},{1,57,0},{1,57,0},{1,57,0},{2,44,2},{2,24,2},{1,57,0},{1,46,0},{3,44,3},{1,57,0},{1,57,0},{1,57,0},{3,44,2},{3,24,2},{1,57,0}  // F
+    {1,10,0},{2,34,4},{1,64,0},{2,75,4},{2,33,0},{2,34,0},{2,2,0}, {2,75,0},{1,36,0},{2,34,1},{1,2,7}, {2,59,1},{3,33,0},{3,34,0},{3,2,0}, {3,75,0}, // 0
+    {2,9,8}, {2,34,5},{1,64,0},{2,75,5},{2,33,2},{2,34,2},{2,2,2}, {2,75,2},{1,13,0},{3,34,3},{1,33,0},{3,75,3},{3,33,2},{3,34,2},{3,2,2}, {3,75,2}, // 1
+    {3,28,0},{2,1,4}, {1,64,0},{2,68,4},{2,6,0}, {2,1,0}, {2,39,0},{2,68,0},{1,38,0},{2,1,1}, {1,39,7},{2,59,1},{3,6,0}, {3,1,0}, {3,39,0},{3,68,0}, // 2
+    {2,7,8}, {2,1,5}, {1,64,0},{2,68,5},{2,33,2},{2,1,2}, {2,39,2},{2,68,2},{1,45,0},{3,1,3}, {1,33,0},{3,68,3},{3,33,2},{3,1,2}, {3,39,2},{3,68,2}, // 3
+    {1,42,0},{2,23,4},{1,64,0},{2,76,4},{2,33,0},{2,23,0},{2,32,0},{2,76,0},{1,35,0},{2,23,1},{1,32,7},{2,58,1},{3,27,0},{3,23,0},{3,32,0},{3,76,0}, // 4
+    {2,11,8},{2,23,5},{1,64,0},{2,76,5},{2,33,2},{2,23,2},{2,32,2},{2,76,2},{1,15,0},{3,23,3},{1,33,0},{3,76,3},{3,33,2},{3,23,2},{3,32,2},{3,76,2}, // 5
+    {1,43,0},{2,0,4}, {1,64,0},{2,69,4},{2,33,0},{2,0,0}, {2,40,0},{2,69,0},{1,37,0},{2,0,1}, {1,40,7},{2,61,1},{3,27,6},{3,0,0}, {3,40,0},{3,69,0}, // 6
+    {2,12,8},{2,0,5}, {1,64,0},{2,69,5},{2,33,2},{2,0,2}, {2,40,2},{2,69,2},{1,47,0},{3,0,3}, {1,33,0},{3,69,3},{3,33,2},{3,0,2}, {3,40,2},{3,69,2}, // 7
+    {2,33,1},{2,48,4},{2,33,1},{2,70,4},{2,50,0},{2,48,0},{2,49,0},{2,70,0},{1,22,0},{2,33,1},{1,54,0},{2,60,1},{3,50,0},{3,48,0},{3,49,0},{3,70,0}, // 8
+    {2,3,8}, {2,48,5},{1,64,0},{2,72,5},{2,50,2},{2,48,2},{2,49,3},{2,70,3},{1,56,0},{3,48,3},{1,55,0},{3,77,3},{3,74,2},{3,48,2},{3,73,3},{3,72,3}, // 9
+    {2,31,1},{2,29,4},{2,30,1},{2,66,4},{2,31,0},{2,29,0},{2,30,0},{2,66,0},{1,52,0},{2,29,1},{1,51,0},{2,67,1},{3,31,0},{3,29,0},{3,30,0},{3,66,0}, // A
+    {2,4,8}, {2,29,5},{1,64,0},{2,66,5},{2,31,2},{2,29,2},{2,30,3},{2,66,3},{1,16,0},{3,29,3},{1,53,0},{3,65,3},{3,31,2},{3,29,2},{3,30,3},{3,66,3}, // B
+    {2,19,1},{2,17,4},{2,33,1},{2,62,4},{2,19,0},{2,17,0},{2,20,0},{2,62,0},{1,26,0},{2,17,1},{1,21,0},{2,71,1},{3,19,0},{3,17,0},{3,20,0},{3,62,0}, // C
+    {2,8,8}, {2,17,5},{1,64,0},{2,62,5},{2,33,2},{2,17,2},{2,20,2},{2,62,2},{1,14,0},{3,17,3},{1,33,0},{3,62,3},{3,33,2},{3,17,2},{3,20,2},{3,62,2}, // D
+    {2,18,1},{2,44,4},{2,33,1},{2,63,4},{2,18,0},{2,44,0},{2,24,0},{2,63,0},{1,25,0},{2,44,1},{1,33,0},{2,44,1},{3,18,0},{3,44,0},{3,24,0},{3,63,0}, // E
+    {2,5,8}, {2,44,5},{1,64,0},{2,63,5},{2,33,2},{2,44,2},{2,24,2},{2,63,2},{1,46,0},{3,44,3},{1,33,0},{3,63,3},{3,33,2},{3,44,2},{3,24,2},{3,63,2}  // F
 };
 // clang-format on
 
-using Memory = std::array<uint8_t, 0x10000>;
-
-unsigned disasm(FILE *fp, const Memory &mem, uint16_t addr) {
-  auto props = opcode_props[mem[addr]];
-  auto paramcount = props[0];
-  auto &mnemonic = mnemonics[props[1]];
-  auto addrmode = props[2];
-  auto pre = modes[addrmode][0];
-  auto post = modes[addrmode][1];
-  auto pad = padding[(paramcount - 1)];
-  unsigned print_len = 0;
+static_assert(opcode_props[0x20].length == 3 && opcode_props[0xff].mnemonic == 63,
+              "Opcode table out of shape");
 
-  print_len += fprintf(fp, "$%04X   ", addr);
-  for (unsigned i = 0; i < paramcount; i++)
-    print_len += fprintf(fp, "$%02X ", mem[addr + i]);
+inline char *Str(char *p, const char *s) {
+  while (*s)
+    *p++ = *s++;
+  return p;
+}
 
-  print_len += fprintf(fp, " %s %s %s", pad, mnemonic, pre);
+inline char *Hex(char *p, unsigned v, unsigned digits) {
+  static constexpr char hex[] = "0123456789ABCDEF";
+  while (digits--)
+    *p++ = hex[(v >> (4 * digits)) & 0xf];
+  return p;
+}
+} // namespace
 
-  if (paramcount == 2) { // Single operand instruction
-    auto byte = mem[addr + 1];
-    if (addrmode == 8) { // Addressing mode is relative
-      print_len +=
-          fprintf(fp, "$%04X", (addr + 2 + ((byte < 128) ? byte : byte - 256)));
-    } else {
-      print_len += fprintf(fp, "$%02X", byte);
+unsigned disasm(char *buf, size_t size, uint16_t addr, const uint8_t *bytes) {
+  if (size < DISASM_MAX_LEN) {
+    char tmp[DISASM_MAX_LEN];
+    unsigned len = disasm(tmp, sizeof(tmp), addr, bytes);
+    if (size > 0) {
+      size_t n = std::min<size_t>(len, size - 1);
+      memcpy(buf, tmp, n);
+      buf[n] = '\0';
     }
+    return len;
   }
-  if (paramcount == 3) // Two operand instruction
-    print_len += fprintf(fp, "$%02X%02X", mem[addr + 2], mem[addr + 1]);
-  print_len += fprintf(fp, "%s", post);
 
-  return print_len;
+  const auto &props = opcode_props[bytes[0]];
+  auto pre = modes[props.mode][0];
+  auto post = modes[props.mode][1];
+  char *p = buf;
+
+  *p++ = '$';
+  p = Hex(p, addr, 4);
+  p = Str(p, "   ");
+  for (unsigned i = 0; i < props.length; i++) {
+    *p++ = '$';
+    p = Hex(p, bytes[i], 2);
+    *p++ = ' ';
+  }
+  *p++ = ' ';
+  p = Str(p, padding[props.length - 1]);
+  *p++ = ' ';
+  p = Str(p, mnemonics[props.mnemonic]);
+  *p++ = ' ';
+  p = Str(p, pre);
+
+  if (props.length == 2) { // Single operand instruction
+    *p++ = '$';
+    if (props.mode == 8) // Addressing mode is relative
+      p = Hex(p, uint16_t(addr + 2 + int8_t(bytes[1])), 4);
+    else
+      p = Hex(p, bytes[1], 2);
+  }
+  if (props.length == 3) { // Two operand instruction
+    *p++ = '$';
+    p = Hex(p, bytes[2], 2);
+    p = Hex(p, bytes[1], 2);
+  }
+  p = Str(p, post);
+  *p = '\0';
+
+  return p - buf;
+}
+
+unsigned disasm(FILE *fp, const Memory &mem, uint16_t addr) {
+  uint8_t bytes[3] = {mem[addr], mem[uint16_t(addr + 1)],
+                      mem[uint16_t(addr + 2)]};
+  char buf[DISASM_MAX_LEN];
+  unsigned len = disasm(buf, sizeof(buf), addr, bytes);
+  fwrite(buf, 1, len, fp);
+  return len;
 }
@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2024 Markus Lavin (https://www.zzzconsulting.se/)
+ *
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <array>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+using Memory = std::array<uint8_t, 0x10000>;
+
+// Longest disassembled instruction including the terminating NUL
+#define DISASM_MAX_LEN 48
+
+// Disassemble the instruction made up of 'bytes' (opcode followed by up to two
+// operand bytes) at 'addr' into 'buf'. Returns the length of the text, which
+// is truncated (as by snprintf) if 'size' is less than DISASM_MAX_LEN.
+unsigned disasm(char *buf, size_t size, uint16_t addr, const uint8_t *bytes);
+// Disassemble the instruction at 'addr' in 'mem' to 'fp'
+unsigned disasm(FILE *fp, const Memory &mem, uint16_t addr);
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2024 Markus Lavin (https://www.zzzconsulting.se/)
+ *
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+// Render a binary CPU trace (core_top-sim --cpu-trace-binary) in the text
+// trace format, optionally restricted to a window of frames, ticks or PCs.
+
+#include "CLI11.hpp"
+#include "trace6502.h"
+#include <iostream>
+#include <limits>
+#include <string.h>
+
+int main(int argc, char *argv[]) {
+  std::string path;
+  uint32_t begin_frame = 0;
+  uint32_t end_frame = std::numeric_limits<uint32_t>::max();
+  uint64_t begin_ticks = 0;
+  uint64_t end_ticks = std::numeric_limits<uint64_t>::max();
+  std::pair<uint16_t, uint16_t> pc_range = {0x0000, 0xffff};
+  uint64_t max_count = std::numeric_limits<uint64_t>::max();
+
+  CLI::App app{"Render binary 6502 instruction trace as text"};
+  app.add_option("trace", path, "Binary trace file")
+      ->required()
+      ->check(CLI::ExistingFile);
+  app.add_option("--begin-frame", begin_frame, "First frame to render");
+  app.add_option("--end-frame", end_frame, "Last frame to render");
+  app.add_option("--begin-ticks", begin_ticks, "First tick to render");
+  app.add_option("--end-ticks", end_ticks, "Last tick to render");
+  app.add_option("--pc-range", pc_range,
+                 "Only render instructions within PC range (inclusive)");
+  app.add_option("--count", max_count, "Stop after rendering this many");
+  CLI11_PARSE(app, argc, argv);
+
+  FILE *fp = fopen(path.c_str(), "rb");
+  Trace6502FileHeader hdr;
+  if (!fp || fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+      memcmp(hdr.magic, TRACE6502_MAGIC, sizeof(hdr.magic))) {
+    std::cerr << "'" << path << "' is not a binary CPU trace\n";
+    return 1;
+  }
+
+  static Trace6502Record buf[4096];
+  uint64_t count = 0;
+  size_t n;
+  while (count < max_count &&
+         (n = fread(buf, sizeof(buf[0]), 4096, fp)) > 0) {
+    for (size_t i = 0; i < n && count < max_count; i++) {
+      const auto &r = buf[i];
+      // Records are in time order so nothing more to render past the window
+      if (r.frame > end_frame || r.ticks > end_ticks) {
+        fclose(fp);
+        return 0;
+      }
+      if (r.frame < begin_frame || r.ticks < begin_ticks ||
+          r.pc < pc_range.first || r.pc > pc_range.second)
+        continue;
+      Trace6502Print(stdout, r);
+      count++;
+    }
+  }
+  fclose(fp);
+  return 0;
+}
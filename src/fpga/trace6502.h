@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2024 Markus Lavin (https://www.zzzconsulting.se/)
+ *
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include "disasm.h"
+#include <stdint.h>
+#include <stdio.h>
+
+// Binary CPU trace (--cpu-trace-binary) is a Trace6502FileHeader followed by
+// one fixed-size record per retired instruction. Registers are the ones seen
+// at the sync of the following instruction, i.e. after 'pc' has executed.
+#define TRACE6502_MAGIC "T6502TR1"
+
+struct Trace6502FileHeader {
+  char magic[8];
+};
+
+struct Trace6502Record {
+  uint64_t ticks;
+  uint32_t frame;
+  uint16_t pc;
+  uint8_t bytes[3]; // Opcode and operand bytes (unused bytes are don't care)
+  uint8_t a;
+  uint8_t x;
+  uint8_t y;
+  uint8_t sp;
+  uint8_t p;
+  uint8_t pad[2];
+};
+static_assert(sizeof(Trace6502Record) == 24, "Trace record layout changed");
+
+// Render a record in the text trace format
+static inline void Trace6502Print(FILE *fp, const Trace6502Record &r) {
+  char buf[DISASM_MAX_LEN];
+  auto pos = disasm(buf, sizeof(buf), r.pc, r.bytes);
+  fwrite(buf, 1, pos, fp);
+  while (pos++ < 40)
+    putc(' ', fp);
+  fprintf(fp, "[A:$%02X X:$%02X Y:$%02X SP:$%02X ", r.a, r.x, r.y, r.sp);
+
+  fprintf(fp, " SR:%c%c-%c%c%c%c%c] ", r.p & 0x80 ? 'N' : '-',
+          r.p & 0x40 ? 'V' : '-', r.p & 0x10 ? 'B' : '-',
+          r.p & 0x08 ? 'D' : '-', r.p & 0x04 ? 'I' : '-',
+          r.p & 0x02 ? 'Z' : '-', r.p & 0x01 ? 'C' : '-');
+
+  fprintf(fp, "[F:%u C:%lu]\n", r.frame, r.ticks);
+}
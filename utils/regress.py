@@ -0,0 +1,309 @@
+#!/usr/bin/env python3
+#
+# Golden frame regression suite driven by core_top-sim.
+#
+# The manifest (.json) lists the workloads, relative paths are relative to the
+# manifest itself:
+#
+#   {
+#     "tolerance": {"pixel": 16, "fraction": 0.001},
+#     "tests": [
+#       {"name": "hello", "keys": "[150]PRINT<SPACE>1<RETURN>", "frames": [200]},
+#       {"name": "foo", "prg": "prgs/foo.prg", "frames": [250, 400],
+#        "hashes": {"400": "0123456789abcdef"}},
+#       {"name": "bar", "crt": "crts/bar.crt", "frames": [600],
+#        "tolerance": {"pixel": 32, "fraction": 0.01}}
+#     ]
+#   }
+#
+# Each frame listed in "frames" is checked, either exactly against an expected
+# hash from "hashes" or against the golden image of the baseline store
+# (BASELINE/NAME/vicii-FRAME.png). A frame whose hash matches the one stored
+# with the golden image passes directly, otherwise the images are compared
+# pixel by pixel and the frame fails if more than "fraction" of the pixels
+# differ by more than "pixel" (perceptually weighted color distance, 0-765).
+# A diff image of the failing pixels is written next to the output.
+#
+# Run with --update to (re)create the baseline from the current outputs.
+#
+
+import argparse
+import concurrent.futures
+import json
+import math
+import os
+import shutil
+import struct
+import subprocess
+import sys
+import time
+import zlib
+
+script_dir = os.path.dirname(os.path.abspath(__file__))
+fpga_dir = os.path.join(script_dir, '..', 'src', 'fpga')
+
+# Files the simulator expects in its working directory
+sim_files = ['bios.vh', 'basic.bin', 'characters.bin', 'kernal.bin', '1540-c000.bin', '1541-e000.bin']
+
+default_tolerance = {'pixel': 16, 'fraction': 0.001}
+
+#
+# Minimal .png reader/writer (8-bit RGB/RGBA, which is what the simulator writes)
+#
+
+def png_read(path):
+  with open(path, 'rb') as f:
+    data = f.read()
+  if data[:8] != b'\x89PNG\r\n\x1a\n':
+    raise ValueError('{}: not a .png'.format(path))
+  pos = 8
+  idat = b''
+  while pos < len(data):
+    length, ctype = struct.unpack('>I4s', data[pos:pos + 8])
+    chunk = data[pos + 8:pos + 8 + length]
+    if ctype == b'IHDR':
+      width, height, depth, color = struct.unpack('>IIBB', chunk[:10])
+      interlace = chunk[12]
+    elif ctype == b'IDAT':
+      idat += chunk
+    elif ctype == b'IEND':
+      break
+    pos += 12 + length
+  if depth != 8 or color not in (2, 6) or interlace:
+    raise ValueError('{}: unsupported .png format'.format(path))
+  bpp = 3 if color == 2 else 4
+  stride = width * bpp
+  raw = zlib.decompress(idat)
+  rgb = bytearray(width * height * 3)
+  prev = bytearray(stride)
+  for y in range(height):
+    ftype = raw[y * (stride + 1)]
+    line = bytearray(raw[y * (stride + 1) + 1:(y + 1) * (stride + 1)])
+    if ftype == 1:
+      for x in range(bpp, stride):
+        line[x] = (line[x] + line[x - bpp]) & 0xff
+    elif ftype == 2:
+      for x in range(stride):
+        line[x] = (line[x] + prev[x]) & 0xff
+    elif ftype == 3:
+      for x in range(stride):
+        left = line[x - bpp] if x >= bpp else 0
+        line[x] = (line[x] + ((left + prev[x]) >> 1)) & 0xff
+    elif ftype == 4:
+      for x in range(stride):
+        a = line[x - bpp] if x >= bpp else 0
+        b = prev[x]
+        c = prev[x - bpp] if x >= bpp else 0
+        p = a + b - c
+        pa, pb, pc = abs(p - a), abs(p - b), abs(p - c)
+        pred = a if pa <= pb and pa <= pc else (b if pb <= pc else c)
+        line[x] = (line[x] + pred) & 0xff
+    if bpp == 3:
+      rgb[y * stride:(y + 1) * stride] = line
+    else:
+      for x in range(width):
+        rgb[(y * width + x) * 3:(y * width + x) * 3 + 3] = line[x * 4:x * 4 + 3]
+    prev = line
+  return width, height, rgb
+
+def png_write(path, width, height, rgb):
+  def chunk(ctype, payload):
+    crc = zlib.crc32(ctype + payload) & 0xffffffff
+    return struct.pack('>I', len(payload)) + ctype + payload + struct.pack('>I', crc)
+  raw = b''.join(b'\x00' + bytes(rgb[y * width * 3:(y + 1) * width * 3]) for y in range(height))
+  with open(path, 'wb') as f:
+    f.write(b'\x89PNG\r\n\x1a\n')
+    f.write(chunk(b'IHDR', struct.pack('>IIBBBBB', width, height, 8, 2, 0, 0, 0)))
+    f.write(chunk(b'IDAT', zlib.compress(raw)))
+    f.write(chunk(b'IEND', b''))
+
+# Color distance weighted for the eye ("redmean"), 0 for identical and 765 for
+# black against white
+def color_distance(r1, g1, b1, r2, g2, b2):
+  rmean = (r1 + r2) / 2
+  dr, dg, db = r1 - r2, g1 - g2, b1 - b2
+  return math.sqrt((2 + rmean / 256) * dr * dr + 4 * dg * dg + (2 + (255 - rmean) / 256) * db * db)
+
+# Returns the fraction of pixels differing by more than the pixel tolerance,
+# and writes the differing pixels in red on a dimmed golden image to diff_path
+def image_diff(out_path, golden_path, tolerance, diff_path):
+  w1, h1, rgb1 = png_read(out_path)
+  w2, h2, rgb2 = png_read(golden_path)
+  if (w1, h1) != (w2, h2):
+    return 1.0
+  diff = bytearray(len(rgb2))
+  num_diff = 0
+  for i in range(0, len(rgb1), 3):
+    if rgb1[i:i + 3] == rgb2[i:i + 3]:
+      d = 0
+    else:
+      d = color_distance(rgb1[i], rgb1[i + 1], rgb1[i + 2], rgb2[i], rgb2[i + 1], rgb2[i + 2])
+    if d > tolerance['pixel']:
+      num_diff += 1
+      diff[i:i + 3] = b'\xff\x00\x00'
+    else:
+      diff[i:i + 3] = bytes(c // 4 for c in rgb2[i:i + 3])
+  if num_diff:
+    png_write(diff_path, w2, h2, diff)
+  return num_diff / (w1 * h1)
+
+def read_hashes(path):
+  hashes = {}
+  if os.path.exists(path):
+    with open(path) as f:
+      for line in f:
+        frame, h = line.split()
+        hashes[int(frame)] = h
+  return hashes
+
+#
+# Running the simulator
+#
+
+def sim_args(test, manifest_dir):
+  # Frames are numbered before the vsync that ends them and the simulator
+  # exits on the vsync reaching --exit-frame, so run one frame past the last
+  args = ['--exit-frame', str(max(test['frames']) + 1),
+          '--dump-video', '--dump-video-threads', '1', '--dump-video-frames'] + [str(f) for f in test['frames']]
+  args += ['--frame-hash', 'hashes.txt']
+  for slot in ('prg', 'g64', 'crt'):
+    if slot in test:
+      args += ['--' + slot, os.path.join(manifest_dir, test[slot])]
+  if 'keys' in test:
+    args += ['--keys', test['keys']]
+  return args
+
+def prepare_dir(path, sim):
+  os.makedirs(path, exist_ok=True)
+  for name in sim_files:
+    dst = os.path.join(path, name)
+    if not os.path.lexists(dst):
+      os.symlink(os.path.join(os.path.dirname(sim), name), dst)
+
+# One simulator process per test
+def run_processes(tests, manifest_dir, out_dir, sim, jobs):
+  def run(test):
+    test_dir = os.path.join(out_dir, test['name'])
+    prepare_dir(test_dir, sim)
+    with open(os.path.join(test_dir, 'sim.log'), 'w') as log:
+      return subprocess.run([sim] + sim_args(test, manifest_dir), cwd=test_dir,
+                            stdout=log, stderr=subprocess.STDOUT).returncode
+  with concurrent.futures.ThreadPoolExecutor(max_workers=jobs) as pool:
+    return dict(zip([t['name'] for t in tests], pool.map(run, tests)))
+
+# One simulator process booting once and forking the tests (--batch)
+def run_batch(tests, manifest_dir, out_dir, sim, jobs, fork_frame):
+  prepare_dir(out_dir, sim)
+  batch_path = os.path.join(out_dir, 'batch.txt')
+  with open(batch_path, 'w') as f:
+    for test in tests:
+      args = sim_args(test, manifest_dir)
+      f.write('{} {}\n'.format(test['name'], ' '.join('"{}"'.format(a) if set(a) & set(' \'') else a for a in args)))
+  cmd = [sim, '--batch', 'batch.txt', '--batch-fork-frame', str(fork_frame), '--batch-jobs', str(jobs)]
+  proc = subprocess.run(cmd, cwd=out_dir, stdout=subprocess.PIPE, universal_newlines=True)
+  with open(os.path.join(out_dir, 'batch.log'), 'w') as f:
+    f.write(proc.stdout)
+  # The exit status of each run as reported by the parent ('batch: NAME ok')
+  returncodes = {t['name']: 1 for t in tests}
+  for line in proc.stdout.splitlines():
+    fields = line.split()
+    if len(fields) == 3 and fields[0] == 'batch:' and fields[1] in returncodes:
+      returncodes[fields[1]] = 0 if fields[2] == 'ok' else 1
+  return returncodes
+
+#
+# Checking the outputs
+#
+
+def check_test(test, test_dir, baseline_dir, tolerance, returncode, update):
+  result = {'name': test['name'], 'status': 'pass', 'frames': {}}
+  if returncode != 0:
+    result['status'] = 'fail'
+    result['error'] = 'simulator exited with {}'.format(returncode)
+  hashes = read_hashes(os.path.join(test_dir, 'hashes.txt'))
+  golden_dir = os.path.join(baseline_dir, test['name'])
+  golden_hashes = read_hashes(os.path.join(golden_dir, 'hashes.txt'))
+  expected = {int(k): v.lower() for k, v in test.get('hashes', {}).items()}
+  for frame in test['frames']:
+    png = 'vicii-{:04d}.png'.format(frame)
+    out_png = os.path.join(test_dir, png)
+    golden_png = os.path.join(golden_dir, png)
+    fr = {'hash': hashes.get(frame)}
+    if fr['hash'] is None or not os.path.exists(out_png):
+      fr['status'] = 'missing'
+    elif frame in expected:
+      fr['status'] = 'pass' if fr['hash'] == expected[frame] else 'fail'
+    elif update:
+      os.makedirs(golden_dir, exist_ok=True)
+      shutil.copy(out_png, golden_png)
+      golden_hashes[frame] = fr['hash']
+      fr['status'] = 'updated'
+    elif not os.path.exists(golden_png):
+      fr['status'] = 'new'
+    elif golden_hashes.get(frame) == fr['hash']:
+      fr['status'] = 'pass'
+    else:
+      diff = image_diff(out_png, golden_png, tolerance, os.path.join(test_dir, 'diff-{:04d}.png'.format(frame)))
+      fr['diff_fraction'] = diff
+      fr['status'] = 'pass' if diff <= tolerance['fraction'] else 'fail'
+    if fr['status'] in ('fail', 'missing', 'new'):
+      result['status'] = 'fail'
+    result['frames'][str(frame)] = fr
+  if update and golden_hashes:
+    with open(os.path.join(golden_dir, 'hashes.txt'), 'w') as f:
+      for frame in sorted(golden_hashes):
+        f.write('{:04d} {}\n'.format(frame, golden_hashes[frame]))
+  return result
+
+def main():
+  parser = argparse.ArgumentParser(description='Golden frame regression suite for core_top-sim')
+  parser.add_argument('manifest', help='test manifest (.json)')
+  parser.add_argument('--sim', default=os.path.join(fpga_dir, 'core_top-sim'), help='simulator binary')
+  parser.add_argument('--baseline', help='baseline store (default MANIFEST.baseline)')
+  parser.add_argument('--out', default='regress-out', help='output directory')
+  parser.add_argument('--summary', help='write summary as .json')
+  parser.add_argument('--jobs', '-j', type=int, default=os.cpu_count(), help='tests run in parallel')
+  parser.add_argument('--batch', type=int, metavar='FRAME',
+                      help='boot once and fork the tests on FRAME (the baseline must be made the same way)')
+  parser.add_argument('--update', action='store_true', help='update the baseline with the current outputs')
+  parser.add_argument('--filter', help='only run tests whose name contains the given string')
+  args = parser.parse_args()
+
+  manifest_dir = os.path.dirname(os.path.abspath(args.manifest))
+  with open(args.manifest) as f:
+    manifest = json.load(f)
+  baseline_dir = os.path.abspath(args.baseline or os.path.splitext(args.manifest)[0] + '.baseline')
+  out_dir = os.path.abspath(args.out)
+  sim = os.path.abspath(args.sim)
+  tests = [t for t in manifest['tests'] if not args.filter or args.filter in t['name']]
+
+  start = time.time()
+  if args.batch:
+    returncodes = run_batch(tests, manifest_dir, out_dir, sim, args.jobs, args.batch)
+  else:
+    returncodes = run_processes(tests, manifest_dir, out_dir, sim, args.jobs)
+  sim_seconds = time.time() - start
+
+  results = []
+  for test in tests:
+    tolerance = dict(default_tolerance)
+    tolerance.update(manifest.get('tolerance', {}))
+    tolerance.update(test.get('tolerance', {}))
+    result = check_test(test, os.path.join(out_dir, test['name']), baseline_dir, tolerance,
+                        returncodes[test['name']], args.update)
+    results.append(result)
+    print('{:<32} {}'.format(test['name'], result['status'].upper()))
+    for frame, fr in sorted(result['frames'].items()):
+      if fr['status'] not in ('pass', 'updated'):
+        extra = ' ({:.4%} of pixels differ)'.format(fr['diff_fraction']) if 'diff_fraction' in fr else ''
+        print('  frame {}: {}{}'.format(frame, fr['status'], extra))
+
+  num_failed = sum(1 for r in results if r['status'] != 'pass')
+  print('{} tests, {} failed, {:.1f} s simulation'.format(len(results), num_failed, sim_seconds))
+  if args.summary:
+    with open(args.summary, 'w') as f:
+      json.dump({'tests': results, 'failed': num_failed, 'seconds': sim_seconds}, f, indent=2)
+  sys.exit(1 if num_failed else 0)
+
+if __name__ == '__main__':
+  main()